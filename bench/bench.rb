@@ -0,0 +1,146 @@
+#!/usr/bin/env ruby
+#
+# Overhead of the sampling engine on a few synthetic workloads, printed as
+# JSON so runs can be kept and compared across stackprof versions:
+#
+#   $ rake bench
+#   $ ruby -Ilib bench/bench.rb deep_recursion heap_allocations > before.json
+#
+# Every workload is timed without the profiler (the best of three runs) and
+# once with it. The difference spread over the samples taken is the cost of
+# a sample, which in custom mode is the cost of StackProf.sample itself.
+# In wall and cpu mode StackProf.stats also times the sampling jobs.
+# Memory is the growth in RSS while profiling: the frame table and raw
+# buffers, and in heap mode the tracked objects too.
+
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'stackprof'
+require 'json'
+require 'rbconfig'
+
+module StackProfBench
+  extend self
+
+  DEPTH = 500
+  WIDTH = 1000
+
+  def recurse(depth, &block)
+    depth == 0 ? yield : recurse(depth - 1, &block)
+  end
+
+  # a fixed amount of work, so the profiler's share shows up in the time
+  def spin(iterations)
+    i = 0
+    i += 1 while i < iterations
+    i
+  end
+
+  # WIDTH distinct leaf methods, all called from the same caller
+  WIDTH.times do |n|
+    define_method("leaf_#{n}"){ 50.times.inject(0){ |sum, i| sum + i * n } }
+  end
+
+  def wide
+    200.times{ |round| WIDTH.times{ |n| send("leaf_#{(n + round) % WIDTH}") } }
+  end
+
+  def allocate
+    200_000.times{ |i| Object.new; "#{i}" }
+  end
+
+  # heap mode only reports the objects still alive when it stops
+  def retain
+    kept = 200_000.times.map{ |i| "#{i}" }
+    kept.size
+  ensure
+    @kept = kept
+  end
+
+  def threads(iterations)
+    4.times.map{ Thread.new{ spin(iterations) } }.each(&:join)
+  end
+
+  SCENARIOS = {
+    deep_recursion: [{ mode: :cpu, interval: 1000, raw: true }, ->{ recurse(DEPTH){ spin(20_000_000) } }],
+    wide_call_graph: [{ mode: :cpu, interval: 1000, raw: true }, ->{ wide }],
+    # StackProf.sample is the workload here, an empty loop the baseline
+    custom_deep: [{ mode: :custom, raw: true }, ->{ recurse(DEPTH){ 100_000.times{ StackProf.sample } } },
+      ->{ recurse(DEPTH){ 100_000.times{} } }],
+    object_allocations: [{ mode: :object, interval: 1, raw: true }, ->{ allocate }],
+    heap_allocations: [{ mode: :heap, interval: 1 }, ->{ retain }],
+    threads_wall: [{ mode: :wall, interval: 1000, raw: true, threads: true }, ->{ threads(5_000_000) }],
+    threads_cpu: [{ mode: :cpu, interval: 1000, raw: true, threads: true }, ->{ threads(5_000_000) }],
+  }
+
+  def measure(name, options, workload, baseline = workload)
+    workload.call # warm up method caches and the allocator
+    base = 3.times.map{ time(&baseline) }.min
+
+    GC.start
+    rss = rss_kb
+    StackProf.start(**options)
+    elapsed = time(&workload)
+    stats = StackProf.stats
+    StackProf.stop
+    grown = rss && rss_kb - rss
+
+    profile = nil
+    results = time{ profile = StackProf.results }
+    dump = time{ Marshal.dump(profile) }
+
+    samples = options[:mode] == :heap ? profile[:frames].each_value.sum{ |frame| frame[:samples] } : profile[:samples]
+    @kept = nil
+    {
+      name: name,
+      options: options,
+      samples: samples,
+      missed_samples: profile[:missed_samples],
+      missed_rate: samples + profile[:missed_samples] > 0 ? profile[:missed_samples].fdiv(samples + profile[:missed_samples]).round(4) : 0.0,
+      frames: profile[:frames].size,
+      raw_nodes: profile[:raw_nodes] ? profile[:raw_nodes].size / 2 : nil,
+      baseline_ms: ms(base),
+      profiled_ms: ms(elapsed),
+      ns_per_sample: samples > 0 ? ((elapsed - base) * 1e9 / samples).round : nil,
+      ns_per_job: stats[:jobs] > 0 ? stats[:job_time_ns] / stats[:jobs] : nil,
+      rss_growth_kb: grown,
+      results_ms: ms(results),
+      marshal_ms: ms(dump),
+    }
+  end
+
+  def run(names)
+    names = SCENARIOS.keys if names.empty?
+    {
+      stackprof: Gem::Specification.load(File.expand_path('../../stackprof.gemspec', __FILE__)).version.to_s,
+      ruby: RUBY_DESCRIPTION,
+      platform: RbConfig::CONFIG['host'],
+      time: Time.now.utc.to_s,
+      scenarios: names.map do |name|
+        scenario = SCENARIOS.fetch(name.to_sym){ abort "unknown scenario #{name}, pick from #{SCENARIOS.keys.join(', ')}" }
+        measure(name.to_sym, *scenario)
+      end
+    }
+  end
+
+  private
+
+  def time
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    yield
+    Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+  end
+
+  def ms(seconds)
+    (seconds * 1000).round(3)
+  end
+
+  # nil where there's no /proc
+  def rss_kb
+    File.foreach('/proc/self/status'){ |line| return line.split[1].to_i if line.start_with?('VmRSS:') }
+    nil
+  rescue SystemCallError
+    nil
+  end
+end
+
+puts JSON.pretty_generate(StackProfBench.run(ARGV))
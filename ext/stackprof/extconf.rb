@@ -1,10 +1,17 @@
 require 'mkmf'
-if have_func('rb_postponed_job_register_one') &&
+# ruby 3.3 deprecates registering postponed jobs by function
+if (have_func('rb_postponed_job_preregister', 'ruby/debug.h') ||
+    have_func('rb_postponed_job_register_one')) &&
    have_func('rb_profile_frames') &&
    have_func('rb_tracepoint_new') &&
    have_func('rb_obj_memsize_of') &&
    have_const('RUBY_INTERNAL_EVENT_NEWOBJ') &&
    have_const('RUBY_INTERNAL_EVENT_FREEOBJ')
+  have_header('sys/mman.h')
+  # per-thread cpu timers (cpu mode with per_thread: true)
+  have_library('rt', 'timer_create')
+  have_func('timer_create', 'time.h')
+  have_func('rb_internal_thread_add_event_hook', 'ruby/thread.h')
   create_makefile('stackprof/stackprof')
 else
   fail 'missing API: are you using ruby 2.1+?'
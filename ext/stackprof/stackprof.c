@@ -13,24 +13,156 @@
 #include <ruby/intern.h>
 #include <ruby/version.h>
 #include <signal.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
 #include <sys/time.h>
 #include <pthread.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_RB_INTERNAL_THREAD_ADD_EVENT_HOOK
+#include <ruby/thread.h>
+#define STACKPROF_THREAD_EVENTS 1
+#if defined(HAVE_TIMER_CREATE) && defined(SIGEV_THREAD_ID)
+#include <unistd.h>
+#include <sys/syscall.h>
+#define STACKPROF_THREAD_TIMERS 1
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+#endif
 #include "vendor/uthash.h"
 
+/* exported by the vm (ObjectSpace.memsize_of uses it), but not declared in its headers */
+size_t rb_obj_memsize_of(VALUE);
+
+/*
+ * Version of the results layout. 1.2 replaced the flat :raw array with the
+ * :raw_nodes trie and :raw_samples, and made frame ids hashes of a frame's
+ * name, file and line rather than object ids.
+ */
+#define RESULTS_VERSION 1.2
+
 #define BUF_SIZE 2048
+#define RING_SIZE 64 /* must be a power of two */
+#define HEAP_SLAB_SIZE (256 * 1024)
+#define HEAP_SIZE_CLASSES 16 /* blocks of 1 << class bytes, up to 32KB */
+#define HEAP_MIN_SIZE_CLASS 5
+#define PENDING_SIZES 256 /* object mode allocations waiting to be sized */
+
+/*
+ * Samples taken during GC are recorded on top of the last sampled stack,
+ * under these stand-ins for frames.
+ */
+#define FAKE_FRAME_GC    INT2FIX(0)
+#define FAKE_FRAME_MARK  INT2FIX(1)
+#define FAKE_FRAME_SWEEP INT2FIX(2)
+#define FAKE_FRAME_P(frame) FIXNUM_P(frame)
+
+/* what the sampled thread was doing, with states: true */
+#define STATE_RUNNING 0
+#define STATE_GVL_WAIT 1
+#define STATE_BLOCKED 2
+#define STATE_GC 3
+#define STATE_COUNT 4
+
+/* samples timed before the interval is reconsidered, with overhead: */
+#define OVERHEAD_WINDOW 32
+#define MAX_INTERVAL 1000000
+
+typedef struct {
+    VALUE frame;
+    size_t weight;
+} frame_edge_t;
+
+/* a frame's lines are kept sorted by line, so each is found by bisection */
+typedef struct {
+    int line;
+    uint64_t total_samples;
+    uint64_t caller_samples;
+} frame_line_t;
 
 typedef struct {
     size_t total_samples;
     size_t caller_samples;
-    st_table *edges;
-    st_table *lines;
+    frame_edge_t *edges;
+    unsigned int edges_len;
+    unsigned int edges_capa;
+    frame_line_t *lines;
+    unsigned int lines_len;
+    unsigned int lines_capa;
+    size_t *states; /* total and self samples per state, with states: true */
+    size_t *bytes; /* total and self bytes, in object and heap mode */
+    uint64_t key; /* stable id, assigned when results are built */
+    VALUE canonical; /* the frame sharing this key that holds the counts */
 } frame_data_t;
 
+/*
+ * Open-addressing table from frame VALUE to its frame_data_t, stored inline
+ * so that a lookup touches a single cache line. A zero frame marks an empty
+ * slot. Pointers into the table are only valid until the next insert.
+ */
 typedef struct {
-    VALUE obj;
+    VALUE frame;
+    frame_data_t data;
+} frame_entry_t;
+
+typedef struct {
+    frame_entry_t *entries;
+    size_t len;
+    size_t capa; /* power of two */
+} frame_table_t;
+
+/*
+ * What a frame resolves to: its name, file and line and the key derived
+ * from them. Resolved frames are cached from a fresh start until results
+ * are taken, and each snapshot keeps only the ones it holds, so frames
+ * sampled again don't get symbolized over and over yet the cache is never
+ * bigger than about one snapshot's frames. Names and files are interned
+ * into one string table, shared by every frame of the results and written
+ * as is by the binary dump, so a file is stored once, not once per frame.
+ */
+typedef struct {
+    VALUE frame;
+    uint32_t name; /* indexes into strings */
+    uint32_t file;
+    VALUE line;
+    uint64_t key;
+} symbol_t;
+
+typedef struct {
+    symbol_t *entries; /* open addressing by frame, like frame_table_t */
+    size_t len;
+    size_t capa;
+    VALUE strings; /* frozen Strings, nil at index 0 */
+    VALUE index; /* String => its index in strings */
+    VALUE *pending; /* frames sampled but not resolved yet, with symbolize: */
+    size_t pending_len;
+    size_t pending_capa;
+} symbol_table_t;
+
+/*
+ * Stacks captured in heap mode are interned: every distinct frames+lines
+ * sequence is stored once, keyed by its contents, and shared by all the
+ * allocations made from it.
+ */
+typedef struct heap_stack {
     int num;
+    size_t refs;
+    size_t bytes;
     VALUE *frames;
-    int *lines_buffer;
+    int *lines;
+    UT_hash_handle hh;
+} heap_stack_t;
+
+typedef struct {
+    VALUE obj;
+    heap_stack_t *stack;
     int living;
     VALUE flags;
     VALUE klass;
@@ -38,36 +170,270 @@ typedef struct {
     UT_hash_handle hh;
 } allocation_info_t;
 
+/*
+ * Heap-mode records are carved out of large slabs in power-of-two sized
+ * blocks, and freed blocks go back on a per-size freelist. All slabs are
+ * released at once when the profiler stops.
+ */
+/*
+ * Objects aren't populated yet when NEWOBJ fires, so in object mode each
+ * sampled allocation is sized from a postponed job instead, and its bytes
+ * charged to the (interned) stack it was allocated from.
+ */
+typedef struct {
+    VALUE obj;
+    heap_stack_t *stack;
+} pending_size_t;
+
+typedef struct heap_slab {
+    struct heap_slab *next;
+    size_t used;
+    char data[HEAP_SLAB_SIZE];
+} heap_slab_t;
+
+typedef struct {
+    heap_slab_t *slabs;
+    void *freelist[HEAP_SIZE_CLASSES];
+} heap_arena_t;
+
+/*
+ * Raw samples are stored as a prefix trie of stacks: every node is a frame
+ * plus the node of its caller, node 0 being the (empty) root. A sample is
+ * then just the node of its topmost frame and a weight.
+ */
+typedef struct {
+    VALUE frame;
+    unsigned int parent;
+} stack_node_t;
+
+typedef struct {
+    unsigned int node;
+    unsigned int weight;
+    unsigned int thread; /* 1-based index into the thread table, 0 if untracked */
+    unsigned int delta; /* usec since the previous sample, with timestamps: true */
+    unsigned int tag; /* 1-based index into the tag table, 0 if untagged */
+} raw_sample_t;
+
+/*
+ * The last sampled stack, root first. Consecutive samples mostly share
+ * their outer frames, so only the frames below the common prefix are
+ * looked up and pushed. Every frame is charged the samples taken while it
+ * was on the cached stack when it's popped, which is the difference
+ * between the running totals then and when it was pushed.
+ */
+typedef struct {
+    VALUE frame;
+    int line;
+    unsigned int node; /* raw trie node of the stack down to this frame */
+    frame_data_t *data;
+    size_t weight; /* stack_weight when it was pushed */
+    size_t states[STATE_COUNT]; /* stack_states when it was pushed */
+} cached_frame_t;
+
+/*
+ * With threads: true (or per_thread) samples are attributed to the thread
+ * and fiber they were taken on. Each distinct pair gets an entry here.
+ */
+typedef struct {
+    VALUE thread;
+    VALUE fiber;
+    unsigned int tid;
+    size_t samples;
+} sample_thread_t;
+
+typedef struct {
+    uint64_t timestamp;
+    VALUE thread;
+    unsigned int tid;
+    unsigned int weight;
+    unsigned int tag;
+    int state;
+    int num;
+    VALUE frames[BUF_SIZE];
+    int lines[BUF_SIZE];
+} sample_record_t;
+
+/*
+ * Single-producer/single-consumer ring of samples captured inside the signal
+ * handler. The producer only advances +head+, the consumer (a postponed job
+ * holding the GVL) only advances +tail+.
+ */
+typedef struct {
+    size_t head;
+    size_t tail;
+    int job_pending;
+    sample_record_t records[RING_SIZE];
+} sample_ring_t;
+
+/*
+ * Held by the producer while it writes into the ring, so there's only ever
+ * one, and by stackprof_stop while it frees the ring, so a handler already
+ * running on another thread finishes with it first. Handlers only try it.
+ */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * With an overhead budget the timer interval is widened to a multiple of
+ * the requested one whenever sampling gets too expensive, and each sample
+ * then counts as that many. An entry is recorded every time it changes.
+ */
+typedef struct {
+    size_t samples; /* overall_samples when the interval took effect */
+    long interval;
+} interval_change_t;
+
+/*
+ * Everything a results hash or dump is built from. StackProf.results and
+ * StackProf.snapshot detach it from the profiler first, so a running
+ * profiler keeps sampling into fresh tables while the old ones are written.
+ */
+typedef struct {
+    int raw;
+    int states;
+    int bytes;
+    int timestamps;
+    uint64_t start_timestamp; /* CLOCK_MONOTONIC, what the first delta counts from */
+    double start_time; /* the same moment as a unix time */
+    size_t state_samples[STATE_COUNT];
+    frame_table_t *frames;
+    sample_thread_t *threads;
+    size_t threads_len;
+    stack_node_t *raw_nodes;
+    size_t raw_nodes_len;
+    raw_sample_t *raw_samples;
+    size_t raw_samples_len;
+    size_t overall_signals;
+    size_t overall_samples;
+    size_t during_gc;
+    interval_change_t *interval_history;
+    size_t interval_history_len;
+    size_t *tag_samples; /* samples per tag index - 1, once a sample is tagged */
+    size_t tag_samples_len;
+    pid_t pid; /* with follow_fork: the process it was collected in */
+} profile_t;
+
 static struct {
     int running;
     int raw;
     int aggregate;
+    int buffered;
+    int per_thread;
+    int track_threads;
+    unsigned int sample_thread;
+    unsigned int sample_tag;
+    unsigned int last_tag; /* of the stack in frames_buffer */
+    int track_states;
+    int sample_state;
+    size_t state_samples[STATE_COUNT];
+    int ignore_gc;
+    int follow_fork;
+    int forked; /* this is a child the profiler followed into */
+    int symbolize;
+    int symbolizing; /* in stackprof_job_symbolize: its allocations aren't sampled */
+    pid_t pid;
+    int last_num; /* frames_buffer holds the last sampled stack */
+    size_t unrecorded_gc_samples;
+    size_t unrecorded_gc_marking;
+    size_t unrecorded_gc_sweeping;
+    int track_bytes;
+    int random;
+    long alloc_interval;
+    long alloc_stride; /* allocations in the current stride, counted down by alloc_countdown */
+    long alloc_countdown;
+    uint64_t random_state;
+    pending_size_t pending_sizes[PENDING_SIZES];
+    int pending_sizes_len;
+    int timestamps;
+    uint64_t sample_timestamp; /* when the sample being processed was taken */
+    uint64_t start_timestamp;
+    uint64_t last_timestamp; /* what the next raw sample's delta counts from */
+    double start_time;
+    double overhead;
+    size_t interval_scale; /* timer interval as a multiple of +interval+ */
+    uint64_t sample_cost;
+    size_t sample_cost_count;
+    interval_change_t *interval_history;
+    size_t interval_history_len;
+    size_t interval_history_capa;
 
     VALUE mode;
     VALUE interval;
     VALUE out;
+    VALUE format;
+
+    stack_node_t *raw_nodes;
+    size_t raw_nodes_len;
+    size_t raw_nodes_capa;
+    unsigned int *raw_nodes_index;
+    size_t raw_nodes_index_capa;
 
-    VALUE *raw_samples;
+    raw_sample_t *raw_samples;
     size_t raw_samples_len;
     size_t raw_samples_capa;
-    size_t raw_sample_index;
 
     size_t overall_signals;
     size_t overall_samples;
     size_t during_gc;
-    st_table *frames;
+    uint64_t job_time; /* ns spent in sampling jobs, for StackProf.stats */
+    size_t jobs;
+    size_t job_register_failures;
+    size_t reentrant_drops;
+    size_t ring_overflows;
+    frame_table_t *frames;
+    sample_ring_t *ring;
+    sample_thread_t *threads;
+    size_t threads_len;
+    size_t threads_capa;
+    size_t *tag_samples;
+    size_t tag_samples_len;
 
     allocation_info_t *frames_heap_live;
+    heap_stack_t *heap_stacks;
+    heap_arena_t heap_arena;
     int heap_all;
     VALUE frames_buffer[BUF_SIZE];
     int lines_buffer[BUF_SIZE];
+    VALUE gc_frames_buffer[BUF_SIZE + 2];
+    int gc_lines_buffer[BUF_SIZE + 2];
+    cached_frame_t stack[BUF_SIZE + 2];
+    int stack_len;
+    size_t stack_capa; /* frames->capa the cached data pointers are into */
+    size_t stack_weight; /* running totals of the samples processed */
+    size_t stack_states[STATE_COUNT];
+    char heap_stack_key[BUF_SIZE * (sizeof(VALUE) + sizeof(int))];
 } _stackprof;
 
 static VALUE sym_object, sym_wall, sym_cpu, sym_custom, sym_name, sym_file, sym_line;
 static VALUE sym_samples, sym_total_samples, sym_missed_samples, sym_edges, sym_lines;
 static VALUE sym_version, sym_mode, sym_interval, sym_raw, sym_frames, sym_out, sym_aggregate;
 static VALUE sym_gc_samples, objtracer, sym_heap, objtracer_newobj, objtracer_freeobj, sym_heap_all;
+static VALUE sym_buffered, sym_raw_nodes, sym_raw_samples, sym_format, sym_marshal, sym_binary;
+static VALUE sym_per_thread, sym_raw_sample_threads, sym_threads, sym_thread_id, sym_fiber_id, sym_native_thread_id;
+static VALUE sym_states, sym_state_names[STATE_COUNT];
+static VALUE sym_ignore_gc, sym_state, sym_marking, sym_sweeping;
+static VALUE sym_overhead, sym_interval_history, sym_bytes, sym_total_bytes, sym_random;
+static VALUE sym_timestamps, sym_raw_timestamp_deltas, sym_raw_start_timestamp, sym_raw_start_time;
+static VALUE sym_running, sym_signals, sym_jobs, sym_job_time_ns, sym_job_register_failures, sym_reentrant_drops;
+static VALUE sym_follow_fork, sym_pid, sym_tags, sym_raw_sample_tags;
+static VALUE sym_symbolize, sym_symbols, sym_symbols_pending;
+static VALUE sym_ring_overflows, sym_frames_capa, sym_frames_load, sym_raw_bytes, sym_heap_live, sym_heap_stacks;
 static VALUE gc_hook;
+/*
+ * The GC phase, kept up to date by gc_phase_tracer while the profiler runs
+ * with its timer and GC samples, so the signal handler only has to load an
+ * int rather than ask the VM.
+ */
+enum { GC_PHASE_NONE, GC_PHASE_MARKING, GC_PHASE_SWEEPING };
+static int gc_phase;
+static VALUE gc_phase_tracer = Qnil;
+/*
+ * StackProf.with_tag interns every tag it's given here, for good: the index
+ * a thread is tagged with stays valid across snapshots and restarts.
+ */
+static VALUE tag_indexes; /* tag => 1-based index */
+static VALUE tag_names; /* tag of index n at n-1 */
+static symbol_table_t symbols;
+static profile_t *detached_profile;
 static VALUE rb_mStackProf;
 static size_t rvalue_size;
 
@@ -75,15 +441,620 @@ static void stackprof_newobj_handler(VALUE, void*);
 static void stackprof_newobj_handler_heap(VALUE, void*);
 static void stackprof_freeobj_handler_heap(VALUE, void*);
 static void stackprof_signal_handler(int sig, siginfo_t* sinfo, void* ucontext);
-static void stackprof_process_sample(VALUE *frames_buffer, int *lines_buffer, int num);
+static void stackprof_process_sample(VALUE *frames_buffer, int *lines_buffer, int num, size_t weight);
+static void stackprof_drain_ring(void);
+static void stackprof_record_gc_samples(void);
+static void stackprof_flush_stack(void);
+
+static void stackprof_job_handler(void *data);
+static void stackprof_job_record_gc(void *data);
+static void stackprof_job_drain_ring(void *data);
+static void stackprof_job_measure_sizes(void *data);
+static void stackprof_job_symbolize(void *data);
+
+/*
+ * Postponed jobs. Ruby 3.3 deprecates registering them by function in favour
+ * of triggering a handle preregistered outside the signal handler, and only
+ * has a few dozen handles to share between extensions, so there stackprof
+ * takes one and its job runs whichever of ours were asked for since it last
+ * ran. Older rubies get each job registered by function.
+ */
+typedef enum {
+    JOB_SAMPLE,
+    JOB_RECORD_GC,
+    JOB_DRAIN_RING,
+    JOB_MEASURE_SIZES,
+    JOB_SYMBOLIZE,
+    JOB_COUNT
+} stackprof_job_t;
+
+static rb_postponed_job_func_t const job_funcs[JOB_COUNT] = {
+    stackprof_job_handler,
+    stackprof_job_record_gc,
+    stackprof_job_drain_ring,
+    stackprof_job_measure_sizes,
+    stackprof_job_symbolize,
+};
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+static rb_postponed_job_handle_t job_handle = POSTPONED_JOB_HANDLE_INVALID;
+static unsigned int jobs_pending; /* 1 << stackprof_job_t of each job asked for */
+
+static void
+stackprof_job_dispatch(void *data)
+{
+    unsigned int pending = __atomic_exchange_n(&jobs_pending, 0, __ATOMIC_ACQUIRE);
+    int job;
+
+    for (job = 0; job < JOB_COUNT; job++)
+	if (pending & (1u << job))
+	    job_funcs[job](0);
+}
+#endif
+
+/* async-signal-safe; 0 when the VM had no room for the job */
+static inline int
+stackprof_trigger_job(stackprof_job_t job)
+{
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    __atomic_fetch_or(&jobs_pending, 1u << job, __ATOMIC_RELEASE);
+    rb_postponed_job_trigger(job_handle);
+    return 1;
+#else
+    return rb_postponed_job_register_one(0, job_funcs[job], 0);
+#endif
+}
+
+static inline size_t
+stackprof_hash_mix(uint64_t h)
+{
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+static frame_table_t *
+frame_table_new(size_t capa)
+{
+    frame_table_t *table = malloc(sizeof(frame_table_t));
+    table->entries = calloc(capa, sizeof(frame_entry_t));
+    table->len = 0;
+    table->capa = capa;
+    return table;
+}
+
+static void
+frame_data_free(frame_data_t *frame_data)
+{
+    free(frame_data->edges);
+    free(frame_data->lines);
+    free(frame_data->states);
+    free(frame_data->bytes);
+    frame_data->edges = NULL;
+    frame_data->lines = NULL;
+    frame_data->states = NULL;
+    frame_data->bytes = NULL;
+}
+
+static void
+frame_table_free(frame_table_t *table)
+{
+    size_t n;
+
+    for (n = 0; n < table->capa; n++)
+	if (table->entries[n].frame)
+	    frame_data_free(&table->entries[n].data);
+    free(table->entries);
+    free(table);
+}
+
+static inline frame_entry_t *
+frame_table_slot(frame_entry_t *entries, size_t capa, VALUE frame)
+{
+    size_t mask = capa - 1;
+    size_t i = stackprof_hash_mix((uint64_t)frame * 0x9e3779b97f4a7c15ULL) & mask;
+
+    while (entries[i].frame && entries[i].frame != frame)
+	i = (i + 1) & mask;
+    return &entries[i];
+}
+
+static void
+frame_table_grow(frame_table_t *table)
+{
+    frame_entry_t *entries = table->entries;
+    size_t n, capa = table->capa;
+
+    table->capa = capa * 2;
+    table->entries = calloc(table->capa, sizeof(frame_entry_t));
+    for (n = 0; n < capa; n++)
+	if (entries[n].frame)
+	    *frame_table_slot(table->entries, table->capa, entries[n].frame) = entries[n];
+    free(entries);
+}
+
+static inline frame_data_t *
+frame_table_lookup(frame_table_t *table, VALUE frame)
+{
+    frame_entry_t *entry = frame_table_slot(table->entries, table->capa, frame);
+
+    if (!entry->frame) {
+	/* keep the table at most half full */
+	if ((table->len + 1) * 2 > table->capa) {
+	    frame_table_grow(table);
+	    entry = frame_table_slot(table->entries, table->capa, frame);
+	}
+	entry->frame = frame;
+	MEMZERO(&entry->data, frame_data_t, 1);
+	table->len++;
+    }
+    return &entry->data;
+}
+
+static inline void
+frame_data_edge_increment(frame_data_t *frame_data, VALUE frame, size_t increment)
+{
+    unsigned int n;
+
+    for (n = 0; n < frame_data->edges_len; n++) {
+	if (frame_data->edges[n].frame == frame) {
+	    frame_data->edges[n].weight += increment;
+	    return;
+	}
+    }
+
+    if (frame_data->edges_len == frame_data->edges_capa) {
+	frame_data->edges_capa = frame_data->edges_capa ? frame_data->edges_capa * 2 : 4;
+	frame_data->edges = realloc(frame_data->edges, sizeof(frame_edge_t) * frame_data->edges_capa);
+    }
+    frame_data->edges[n].frame = frame;
+    frame_data->edges[n].weight = increment;
+    frame_data->edges_len++;
+}
+
+static inline void
+frame_data_line_increment(frame_data_t *frame_data, int line, uint64_t total, uint64_t caller)
+{
+    frame_line_t *lines = frame_data->lines;
+    unsigned int lo = 0, hi = frame_data->lines_len, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (lines[mid].line < line)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    if (lo == frame_data->lines_len || lines[lo].line != line) {
+	if (frame_data->lines_len == frame_data->lines_capa) {
+	    frame_data->lines_capa = frame_data->lines_capa ? frame_data->lines_capa * 2 : 4;
+	    frame_data->lines = lines = realloc(lines, sizeof(frame_line_t) * frame_data->lines_capa);
+	}
+	memmove(&lines[lo + 1], &lines[lo], sizeof(frame_line_t) * (frame_data->lines_len - lo));
+	lines[lo].line = line;
+	lines[lo].total_samples = lines[lo].caller_samples = 0;
+	frame_data->lines_len++;
+    }
+    lines[lo].total_samples += total;
+    lines[lo].caller_samples += caller;
+}
+
+static inline int
+heap_size_class(size_t size)
+{
+    int size_class = HEAP_MIN_SIZE_CLASS;
+
+    while (((size_t)1 << size_class) < size)
+	size_class++;
+    return size_class;
+}
+
+static void *
+heap_arena_alloc(heap_arena_t *arena, size_t size)
+{
+    heap_slab_t *slab = arena->slabs;
+    int size_class = heap_size_class(size);
+    void *block;
+
+    if ((block = arena->freelist[size_class])) {
+	arena->freelist[size_class] = *(void **)block;
+	return block;
+    }
+
+    size = (size_t)1 << size_class;
+    if (!slab || slab->used + size > HEAP_SLAB_SIZE) {
+	slab = malloc(sizeof(heap_slab_t));
+	slab->next = arena->slabs;
+	slab->used = 0;
+	arena->slabs = slab;
+    }
+    block = slab->data + slab->used;
+    slab->used += size;
+
+    return block;
+}
+
+/* +size+ must be the size the block was allocated with */
+static void
+heap_arena_free(heap_arena_t *arena, void *block, size_t size)
+{
+    int size_class = heap_size_class(size);
+
+    *(void **)block = arena->freelist[size_class];
+    arena->freelist[size_class] = block;
+}
+
+static void
+heap_arena_release(heap_arena_t *arena)
+{
+    heap_slab_t *slab, *next;
+
+    for (slab = arena->slabs; slab; slab = next) {
+	next = slab->next;
+	free(slab);
+    }
+    MEMZERO(arena, heap_arena_t, 1);
+}
+
+/* frames and then lines are stored inline, right after the header */
+#define HEAP_STACK_HEADER_SIZE ((sizeof(heap_stack_t) + sizeof(VALUE) - 1) & ~(sizeof(VALUE) - 1))
+#define HEAP_STACK_KEY_SIZE(num) ((size_t)(num) * (sizeof(VALUE) + sizeof(int)))
+
+/* find or add the interned copy of frames+lines, and take a reference on it */
+static heap_stack_t *
+heap_stack_ref(VALUE *frames, int *lines, int num)
+{
+    heap_stack_t *stack = NULL;
+    char *key = _stackprof.heap_stack_key;
+    size_t keylen = HEAP_STACK_KEY_SIZE(num);
+
+    /* the key is the frames immediately followed by the lines */
+    memcpy(key, frames, sizeof(VALUE) * num);
+    memcpy(key + sizeof(VALUE) * num, lines, sizeof(int) * num);
+
+    HASH_FIND(hh, _stackprof.heap_stacks, key, keylen, stack);
+    if (!stack) {
+	stack = heap_arena_alloc(&_stackprof.heap_arena, HEAP_STACK_HEADER_SIZE + keylen);
+	stack->num = num;
+	stack->refs = 0;
+	stack->bytes = 0;
+	stack->frames = (VALUE *)((char *)stack + HEAP_STACK_HEADER_SIZE);
+	stack->lines = (int *)(stack->frames + num);
+	memcpy(stack->frames, key, keylen);
+	HASH_ADD_KEYPTR(hh, _stackprof.heap_stacks, stack->frames, keylen, stack);
+    }
+
+    stack->refs++;
+    return stack;
+}
+
+static void
+heap_stack_unref(heap_stack_t *stack)
+{
+    if (--stack->refs == 0) {
+	HASH_DEL(_stackprof.heap_stacks, stack);
+	heap_arena_free(&_stackprof.heap_arena, stack, HEAP_STACK_HEADER_SIZE + HEAP_STACK_KEY_SIZE(stack->num));
+    }
+}
+
+static void
+heap_release(void)
+{
+    HASH_CLEAR(hh, _stackprof.frames_heap_live);
+    HASH_CLEAR(hh, _stackprof.heap_stacks);
+    heap_arena_release(&_stackprof.heap_arena);
+}
+
+/*
+ * the tag index of StackProf.with_tag blocks running on this native thread.
+ * The signal handler can only reach thread-locals safely, so fibers sharing
+ * the thread share the tag too.
+ */
+static __thread unsigned int thread_tag __attribute__((tls_model("initial-exec")));
+
+#ifdef STACKPROF_THREAD_EVENTS
+/*
+ * With states: true every thread tracks whether it holds the GVL, is
+ * waiting for it, or released it to block, so the signal handler can tag
+ * the stack it captures. Threads that haven't switched since the profiler
+ * started count as running.
+ */
+static __thread int thread_state __attribute__((tls_model("initial-exec")));
+static rb_internal_thread_event_hook_t *thread_state_hook;
+
+static void
+thread_state_event(rb_event_flag_t event, const rb_internal_thread_event_data_t *data, void *arg)
+{
+    if (event == RUBY_INTERNAL_THREAD_EVENT_RESUMED)
+	thread_state = STATE_RUNNING;
+    else if (event == RUBY_INTERNAL_THREAD_EVENT_READY)
+	thread_state = STATE_GVL_WAIT;
+    else if (event == RUBY_INTERNAL_THREAD_EVENT_SUSPENDED)
+	thread_state = STATE_BLOCKED;
+}
+#endif
+
+#ifdef STACKPROF_THREAD_TIMERS
+/*
+ * per_thread cpu profiling: instead of one process-wide ITIMER_PROF, every
+ * ruby thread gets its own CLOCK_THREAD_CPUTIME_ID timer that signals that
+ * very thread, so each one is sampled in proportion to its own cpu time.
+ * Timers are created lazily the first time a thread takes the GVL while
+ * profiling, and deleted when it exits or the profiler stops.
+ */
+typedef struct {
+    timer_t timer;
+    pid_t tid;
+} thread_timer_t;
+
+static struct {
+    pthread_mutex_t lock;
+    thread_timer_t *timers;
+    size_t len;
+    size_t capa;
+    unsigned int generation; /* bumped on stop, so threads re-arm on the next start */
+    long interval;
+    rb_internal_thread_event_hook_t *hook;
+} thread_timers = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 1, 0, NULL };
+
+/* static tls, so reading these in the signal handler never allocates */
+static __thread unsigned int thread_timer_generation __attribute__((tls_model("initial-exec")));
+static __thread pid_t thread_tid __attribute__((tls_model("initial-exec")));
+
+static void
+thread_timer_spec(struct itimerspec *its, long interval)
+{
+    its->it_interval.tv_sec = interval / 1000000;
+    its->it_interval.tv_nsec = (interval % 1000000) * 1000;
+    its->it_value = its->it_interval;
+}
+
+static void
+thread_timer_create(void)
+{
+    struct sigevent sev;
+    struct itimerspec its;
+    timer_t timer;
+
+    if (thread_timer_generation == thread_timers.generation)
+	return;
+    thread_timer_generation = thread_timers.generation;
+    if (!thread_tid)
+	thread_tid = (pid_t)syscall(SYS_gettid);
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = thread_tid;
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer))
+	return;
+
+    thread_timer_spec(&its, thread_timers.interval);
+    timer_settime(timer, 0, &its, NULL);
+
+    pthread_mutex_lock(&thread_timers.lock);
+    if (thread_timers.len == thread_timers.capa) {
+	thread_timers.capa = thread_timers.capa ? thread_timers.capa * 2 : 16;
+	thread_timers.timers = realloc(thread_timers.timers, sizeof(thread_timer_t) * thread_timers.capa);
+    }
+    thread_timers.timers[thread_timers.len].timer = timer;
+    thread_timers.timers[thread_timers.len].tid = thread_tid;
+    thread_timers.len++;
+    pthread_mutex_unlock(&thread_timers.lock);
+}
+
+static void
+thread_timer_delete(void)
+{
+    size_t n;
+
+    pthread_mutex_lock(&thread_timers.lock);
+    for (n = 0; n < thread_timers.len; n++) {
+	if (thread_timers.timers[n].tid == thread_tid) {
+	    timer_delete(thread_timers.timers[n].timer);
+	    thread_timers.timers[n] = thread_timers.timers[--thread_timers.len];
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&thread_timers.lock);
+}
+
+static void
+thread_timer_event(rb_event_flag_t event, const rb_internal_thread_event_data_t *data, void *arg)
+{
+    if (event == RUBY_INTERNAL_THREAD_EVENT_RESUMED)
+	thread_timer_create();
+    else if (event == RUBY_INTERNAL_THREAD_EVENT_EXITED)
+	thread_timer_delete();
+}
+
+static void
+thread_timers_start(long interval)
+{
+    thread_timers.interval = interval;
+    thread_timers.hook = rb_internal_thread_add_event_hook(thread_timer_event,
+	RUBY_INTERNAL_THREAD_EVENT_RESUMED | RUBY_INTERNAL_THREAD_EVENT_EXITED, NULL);
+    /* the current thread already holds the GVL, so it won't see a RESUMED */
+    thread_timer_create();
+}
+
+/* re-arms every thread's timer, and the ones created from now on */
+static void
+thread_timers_set_interval(long interval)
+{
+    struct itimerspec its;
+    size_t n;
+
+    thread_timer_spec(&its, interval);
+    pthread_mutex_lock(&thread_timers.lock);
+    thread_timers.interval = interval;
+    for (n = 0; n < thread_timers.len; n++)
+	timer_settime(thread_timers.timers[n].timer, 0, &its, NULL);
+    pthread_mutex_unlock(&thread_timers.lock);
+}
+
+static void
+thread_timers_stop(int inherited)
+{
+    size_t n;
+
+    if (thread_timers.hook) {
+	rb_internal_thread_remove_event_hook(thread_timers.hook);
+	thread_timers.hook = NULL;
+    }
+
+    pthread_mutex_lock(&thread_timers.lock);
+    /* timers aren't inherited across fork, the child only forgets them */
+    if (!inherited)
+	for (n = 0; n < thread_timers.len; n++)
+	    timer_delete(thread_timers.timers[n].timer);
+    thread_timers.len = 0;
+    thread_timers.generation++;
+    pthread_mutex_unlock(&thread_timers.lock);
+}
+#endif
+
+static inline uint64_t
+stackprof_timestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* raw sample timestamps of a new profile count from now */
+static void
+stackprof_reset_clock(void)
+{
+    struct timespec ts;
+
+    _stackprof.start_timestamp = _stackprof.last_timestamp = stackprof_timestamp();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    _stackprof.start_time = ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, plenty for picking sampling strides */
+static inline uint64_t
+stackprof_random(void)
+{
+    uint64_t x = _stackprof.random_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    _stackprof.random_state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * How many allocations until the next sample. With random: true strides
+ * are geometrically distributed with a mean of alloc_interval, as if every
+ * allocation were sampled independently with probability 1/interval, so
+ * they can't line up with a loop that allocates in a fixed pattern.
+ */
+static long
+stackprof_next_stride(void)
+{
+    double u;
+
+    if (!_stackprof.random || _stackprof.alloc_interval <= 1)
+	return _stackprof.alloc_interval;
+
+    /* uniform in (0, 1] */
+    u = ((stackprof_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return 1 + (long)fmin(log(u) / log1p(-1.0 / _stackprof.alloc_interval), 1e15);
+}
+
+static void
+stackprof_start_allocation_sampling(long interval, int random)
+{
+    _stackprof.random = random;
+    _stackprof.alloc_interval = interval > 0 ? interval : 1;
+    if (random && !_stackprof.random_state)
+	_stackprof.random_state = stackprof_timestamp() ^ ((uint64_t)getpid() << 32) ^ 0x9e3779b97f4a7c15ULL;
+    _stackprof.alloc_stride = _stackprof.alloc_countdown = stackprof_next_stride();
+}
+
+/*
+ * The NEWOBJ hooks only count allocations down; this adds the ones
+ * counted since the last sample to overall_signals.
+ */
+static void
+stackprof_count_allocations(void)
+{
+    _stackprof.overall_signals += _stackprof.alloc_stride - _stackprof.alloc_countdown;
+    _stackprof.alloc_stride = _stackprof.alloc_countdown;
+}
+
+/* called when the countdown runs out: the allocation being made is sampled */
+static inline void
+stackprof_next_allocation_sample(void)
+{
+    _stackprof.overall_signals += _stackprof.alloc_stride;
+    _stackprof.alloc_stride = _stackprof.alloc_countdown = stackprof_next_stride();
+}
+
+static void
+stackprof_set_timer(VALUE mode, long interval)
+{
+    struct itimerval timer;
+
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+}
+
+static void
+stackprof_push_interval(long interval)
+{
+    interval_change_t *change;
+
+    if (_stackprof.interval_history_capa <= _stackprof.interval_history_len) {
+	_stackprof.interval_history_capa = _stackprof.interval_history_capa ? _stackprof.interval_history_capa * 2 : 16;
+	_stackprof.interval_history = realloc(_stackprof.interval_history, sizeof(interval_change_t) * _stackprof.interval_history_capa);
+    }
+    change = &_stackprof.interval_history[_stackprof.interval_history_len++];
+    change->samples = _stackprof.overall_samples;
+    change->interval = interval;
+}
+
+static void
+stackprof_gc_phase_event(VALUE tpval, void *data)
+{
+    rb_event_flag_t event = rb_tracearg_event_flag(rb_tracearg_from_tracepoint(tpval));
+    int phase = GC_PHASE_NONE;
+
+    if (event == RUBY_INTERNAL_EVENT_GC_START)
+	phase = GC_PHASE_MARKING;
+    else if (event == RUBY_INTERNAL_EVENT_GC_END_MARK)
+	phase = GC_PHASE_SWEEPING;
+    __atomic_store_n(&gc_phase, phase, __ATOMIC_RELAXED);
+}
+
+/* the tracer only sees phases change, so a GC already under way is asked about */
+static void
+stackprof_gc_phase_init(void)
+{
+    VALUE state = rb_gc_latest_gc_info(sym_state);
+    int phase = GC_PHASE_NONE;
+
+    if (state == sym_marking)
+	phase = GC_PHASE_MARKING;
+    else if (state == sym_sweeping)
+	phase = GC_PHASE_SWEEPING;
+    __atomic_store_n(&gc_phase, phase, __ATOMIC_RELAXED);
+}
 
 static VALUE
 stackprof_start(int argc, VALUE *argv, VALUE self)
 {
     struct sigaction sa;
-    struct itimerval timer;
-    VALUE opts = Qnil, mode = Qnil, interval = Qnil, out = Qfalse;
-    int raw = 0, aggregate = 1, heap_all = 0;
+    VALUE opts = Qnil, mode = Qnil, interval = Qnil, out = Qfalse, format = Qnil;
+    int raw = 0, aggregate = 1, heap_all = 0, buffered = 0, per_thread = 0, threads = 0, states = 0, ignore_gc = 0;
+    int timestamps = 0, random = 0, follow_fork = 0, symbolize = 0;
+    double overhead = 0;
 
     if (_stackprof.running)
 	return Qfalse;
@@ -94,6 +1065,7 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
 	mode = rb_hash_aref(opts, sym_mode);
 	interval = rb_hash_aref(opts, sym_interval);
 	out = rb_hash_aref(opts, sym_out);
+	format = rb_hash_aref(opts, sym_format);
 
 	if (RTEST(rb_hash_aref(opts, sym_raw)))
 	    raw = 1;
@@ -101,15 +1073,76 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
 	    aggregate = 0;
         if (RTEST(rb_hash_aref(opts, sym_heap_all)))
 	    heap_all = 1;
+	if (RTEST(rb_hash_aref(opts, sym_buffered)))
+	    buffered = 1;
+	if (RTEST(rb_hash_aref(opts, sym_per_thread)))
+	    per_thread = 1;
+	if (RTEST(rb_hash_aref(opts, sym_threads)))
+	    threads = 1;
+	if (RTEST(rb_hash_aref(opts, sym_states)))
+	    states = 1;
+	if (RTEST(rb_hash_aref(opts, sym_ignore_gc)))
+	    ignore_gc = 1;
+	if (RTEST(rb_hash_aref(opts, sym_timestamps)))
+	    raw = timestamps = 1;
+	if (RTEST(rb_hash_aref(opts, sym_random)))
+	    random = 1;
+	if (RTEST(rb_hash_aref(opts, sym_follow_fork)))
+	    follow_fork = 1;
+	if (RTEST(rb_hash_aref(opts, sym_symbolize)))
+	    symbolize = 1;
+	if (RTEST(rb_hash_aref(opts, sym_overhead))) {
+	    overhead = NUM2DBL(rb_hash_aref(opts, sym_overhead));
+	    if (!(overhead > 0 && overhead < 1))
+		rb_raise(rb_eArgError, "overhead must be between 0 and 1");
+	}
     }
     if (!RTEST(mode)) mode = sym_wall;
+    if (!RTEST(format)) format = sym_marshal;
+    if (format != sym_marshal && format != sym_binary)
+	rb_raise(rb_eArgError, "unknown dump format");
+    if (per_thread) {
+#ifdef STACKPROF_THREAD_TIMERS
+	if (mode != sym_cpu)
+	    rb_raise(rb_eArgError, "per_thread is only supported in cpu mode");
+	/* the signalled thread has to capture its own stack */
+	buffered = 1;
+#else
+	rb_raise(rb_eNotImpError, "per_thread cpu timers are not supported on this platform");
+#endif
+    }
+    if (states) {
+#ifdef STACKPROF_THREAD_EVENTS
+	if (mode != sym_wall && mode != sym_cpu)
+	    rb_raise(rb_eArgError, "states are only supported in wall and cpu mode");
+	/* the state is the signalled thread's, so it has to capture its own stack */
+	buffered = 1;
+#else
+	rb_raise(rb_eNotImpError, "thread states are not supported on this ruby");
+#endif
+    }
+    if (overhead && mode != sym_wall && mode != sym_cpu)
+	rb_raise(rb_eArgError, "overhead is only supported in wall and cpu mode");
+    if (random && mode != sym_object && mode != sym_heap)
+	rb_raise(rb_eArgError, "random is only supported in object and heap mode");
 
     if (!_stackprof.frames) {
-	_stackprof.frames = st_init_numtable();
+	_stackprof.frames = frame_table_new(1024);
 	_stackprof.overall_signals = 0;
 	_stackprof.overall_samples = 0;
 	_stackprof.during_gc = 0;
+	_stackprof.interval_history_len = 0;
+	_stackprof.job_time = 0;
+	_stackprof.jobs = 0;
+	_stackprof.job_register_failures = 0;
+	_stackprof.reentrant_drops = 0;
+	_stackprof.ring_overflows = 0;
+	stackprof_reset_clock();
     }
+    _stackprof.overhead = overhead;
+    _stackprof.interval_scale = 1;
+    _stackprof.sample_cost = 0;
+    _stackprof.sample_cost_count = 0;
 
     if (!_stackprof.frames_heap_live) {
         _stackprof.frames_heap_live = NULL;
@@ -117,25 +1150,58 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
 
     if (mode == sym_object) {
 	if (!RTEST(interval)) interval = INT2FIX(1);
+	stackprof_start_allocation_sampling(NUM2LONG(interval), random);
 
 	objtracer = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_NEWOBJ, stackprof_newobj_handler, 0);
 	rb_tracepoint_enable(objtracer);
     } else if (mode == sym_wall || mode == sym_cpu) {
 	if (!RTEST(interval)) interval = INT2FIX(1000);
 
+	if (buffered) {
+	    _stackprof.ring = malloc(sizeof(sample_ring_t));
+	    _stackprof.ring->head = _stackprof.ring->tail = 0;
+	    _stackprof.ring->job_pending = 0;
+	}
+
+#ifdef STACKPROF_THREAD_EVENTS
+	if (states) {
+	    _stackprof.track_states = 1;
+	    thread_state_hook = rb_internal_thread_add_event_hook(thread_state_event,
+		RUBY_INTERNAL_THREAD_EVENT_READY | RUBY_INTERNAL_THREAD_EVENT_RESUMED | RUBY_INTERNAL_THREAD_EVENT_SUSPENDED, NULL);
+	}
+#endif
+
+	if (!ignore_gc) {
+	    stackprof_gc_phase_init();
+	    gc_phase_tracer = rb_tracepoint_new(Qnil,
+		RUBY_INTERNAL_EVENT_GC_START | RUBY_INTERNAL_EVENT_GC_END_MARK | RUBY_INTERNAL_EVENT_GC_END_SWEEP,
+		stackprof_gc_phase_event, 0);
+	    rb_tracepoint_enable(gc_phase_tracer);
+	}
+
 	sa.sa_sigaction = stackprof_signal_handler;
 	sa.sa_flags = SA_RESTART | SA_SIGINFO;
 	sigemptyset(&sa.sa_mask);
 	sigaction(mode == sym_wall ? SIGALRM : SIGPROF, &sa, NULL);
 
-	timer.it_interval.tv_sec = 0;
-	timer.it_interval.tv_usec = NUM2LONG(interval);
-	timer.it_value = timer.it_interval;
-	setitimer(mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+#ifdef STACKPROF_THREAD_TIMERS
+	if (per_thread) {
+	    /* set before the first timer can fire */
+	    _stackprof.per_thread = 1;
+	    _stackprof.buffered = 1;
+	    _stackprof.mode = mode;
+	    thread_timers_start(NUM2LONG(interval));
+	} else
+#endif
+	stackprof_set_timer(mode, NUM2LONG(interval));
+	if (overhead)
+	    stackprof_push_interval(NUM2LONG(interval));
     } else if (mode == sym_custom) {
 	/* sampled manually */
 	interval = Qnil;
+	buffered = 0;
     } else if (mode == sym_heap) {
+	stackprof_start_allocation_sampling(RTEST(interval) ? NUM2LONG(interval) : 1, random);
         objtracer_newobj = rb_tracepoint_new(Qnil, RUBY_INTERNAL_EVENT_NEWOBJ, stackprof_newobj_handler_heap, 0);
         rb_tracepoint_enable(objtracer_newobj);
 
@@ -151,7 +1217,20 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
     _stackprof.mode = mode;
     _stackprof.interval = interval;
     _stackprof.out = out;
+    _stackprof.format = format;
     _stackprof.heap_all = heap_all;
+    _stackprof.buffered = buffered && _stackprof.ring;
+    _stackprof.per_thread = per_thread;
+    _stackprof.track_threads = threads;
+    _stackprof.track_states = states;
+    _stackprof.ignore_gc = ignore_gc;
+    _stackprof.timestamps = timestamps;
+    _stackprof.follow_fork = follow_fork;
+    _stackprof.symbolize = symbolize;
+    _stackprof.pid = getpid();
+    _stackprof.track_bytes = mode == sym_object || mode == sym_heap;
+    _stackprof.pending_sizes_len = 0;
+    _stackprof.last_num = 0;
 
     return Qtrue;
 }
@@ -159,52 +1238,141 @@ stackprof_start(int argc, VALUE *argv, VALUE self)
 static size_t
 get_object_size(VALUE obj)
 {
-    VALUE flags = RBASIC(obj)->flags;
-    VALUE klass = RBASIC_CLASS(obj);
     size_t objsize = 0;
 
-    if (flags) {
-        switch (klass) {
-        case T_NONE:
-        case T_ICLASS:
-        case T_NODE:
-        case T_ZOMBIE:
-            break;
+    switch (BUILTIN_TYPE(obj)) {
+    case T_NONE:
+    case T_ICLASS:
+    case T_NODE:
+    case T_ZOMBIE:
+    case T_MOVED:
+        break;
 
-        case T_CLASS:
-            if (FL_TEST(obj, FL_SINGLETON))
-                break;
-        default:
-            if (klass == 0 || rb_obj_is_kind_of(obj, klass)) {
-                objsize = rb_obj_memsize_of(obj);
-            }
-        }
+    case T_CLASS:
+        if (FL_TEST(obj, FL_SINGLETON))
+            break;
+    default:
+        objsize = rb_obj_memsize_of(obj);
     }
 
     return objsize + rvalue_size;
 }
 
-static VALUE
-stackprof_stop(VALUE self)
+/* charges +bytes+ to the frames of a stack that was already sampled */
+static void
+stackprof_add_bytes(VALUE *frames, int num, size_t bytes)
 {
-    struct sigaction sa;
-    struct itimerval timer;
-    allocation_info_t *info, *tmp;
+    int i;
 
-    if (!_stackprof.running)
-	return Qfalse;
-    _stackprof.running = 0;
+    for (i = 0; i < num; i++) {
+	frame_data_t *frame_data = frame_table_lookup(_stackprof.frames, frames[i]);
 
-    if (_stackprof.mode == sym_object) {
-	rb_tracepoint_disable(objtracer);
-    } else if (_stackprof.mode == sym_wall || _stackprof.mode == sym_cpu) {
-	memset(&timer, 0, sizeof(timer));
-	setitimer(_stackprof.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+	if (!frame_data->bytes)
+	    frame_data->bytes = calloc(2, sizeof(size_t));
+	frame_data->bytes[0] += bytes;
+	if (i == 0)
+	    frame_data->bytes[1] += bytes;
+    }
+}
 
-	sa.sa_handler = SIG_IGN;
-	sa.sa_flags = SA_RESTART;
+static void
+stackprof_measure_pending_sizes(void)
+{
+    int n;
+
+    for (n = 0; n < _stackprof.pending_sizes_len; n++) {
+	pending_size_t *pending = &_stackprof.pending_sizes[n];
+
+	stackprof_add_bytes(pending->stack->frames, pending->stack->num, get_object_size(pending->obj));
+	heap_stack_unref(pending->stack);
+    }
+    _stackprof.pending_sizes_len = 0;
+}
+
+static void
+stackprof_job_measure_sizes(void *data)
+{
+    if (!_stackprof.running || _stackprof.mode != sym_object) return;
+
+    stackprof_measure_pending_sizes();
+}
+
+/* queues the object just sampled, whose stack is still in frames_buffer */
+static void
+stackprof_defer_object_size(VALUE obj)
+{
+    pending_size_t *pending;
+
+    /* everything queued before this one is populated by now */
+    if (_stackprof.pending_sizes_len == PENDING_SIZES)
+	stackprof_measure_pending_sizes();
+    if (_stackprof.pending_sizes_len == 0)
+	stackprof_trigger_job(JOB_MEASURE_SIZES);
+
+    pending = &_stackprof.pending_sizes[_stackprof.pending_sizes_len++];
+    pending->obj = obj;
+    pending->stack = heap_stack_ref(_stackprof.frames_buffer, _stackprof.lines_buffer, _stackprof.last_num);
+}
+
+static VALUE
+stackprof_stop(VALUE self)
+{
+    struct sigaction sa;
+    struct itimerval timer;
+    allocation_info_t *info, *tmp;
+    heap_stack_t *stack, *stack_tmp;
+
+    if (!_stackprof.running)
+	return Qfalse;
+    _stackprof.running = 0;
+
+    if (_stackprof.mode == sym_object) {
+	rb_tracepoint_disable(objtracer);
+	stackprof_count_allocations();
+	stackprof_measure_pending_sizes();
+	heap_release();
+    } else if (_stackprof.mode == sym_wall || _stackprof.mode == sym_cpu) {
+#ifdef STACKPROF_THREAD_EVENTS
+	if (thread_state_hook) {
+	    rb_internal_thread_remove_event_hook(thread_state_hook);
+	    thread_state_hook = NULL;
+	}
+#endif
+#ifdef STACKPROF_THREAD_TIMERS
+	if (_stackprof.per_thread)
+	    thread_timers_stop(0);
+	else
+#endif
+	{
+	    memset(&timer, 0, sizeof(timer));
+	    setitimer(_stackprof.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+	}
+
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = SA_RESTART;
 	sigemptyset(&sa.sa_mask);
 	sigaction(_stackprof.mode == sym_wall ? SIGALRM : SIGPROF, &sa, NULL);
+
+	if (RTEST(gc_phase_tracer)) {
+	    rb_tracepoint_disable(gc_phase_tracer);
+	    gc_phase_tracer = Qnil;
+	}
+
+	if (_stackprof.ring) {
+	    sample_ring_t *ring;
+
+	    /* waits out a handler still buffering on another thread */
+	    pthread_mutex_lock(&ring_lock);
+	    /* record whatever the signal handler buffered before the timer stopped */
+	    stackprof_drain_ring();
+	    ring = _stackprof.ring;
+	    _stackprof.ring = NULL;
+	    _stackprof.buffered = 0;
+	    pthread_mutex_unlock(&ring_lock);
+	    free(ring);
+	}
+	if (_stackprof.unrecorded_gc_samples)
+	    stackprof_record_gc_samples();
     } else if (_stackprof.mode == sym_custom) {
 	/* sampled manually */
     } else if (_stackprof.mode == sym_heap) {
@@ -213,506 +1381,2708 @@ stackprof_stop(VALUE self)
 
         rb_tracepoint_disable(objtracer_newobj);
         rb_tracepoint_disable(objtracer_freeobj);
+        stackprof_count_allocations();
 
+        // Objects still alive are sized now, freed ones (with heap_all)
+        // were sized as they were freed.
         HASH_ITER(hh, _stackprof.frames_heap_live, info, tmp) {
-            if (info->frames) {
-                if (info->living && !info->memsize) {
-                    info->memsize = 0; //get_object_size(info->obj);
-                }
-                stackprof_process_sample(info->frames, info->lines_buffer, info->num);
-            }
-            HASH_DEL(_stackprof.frames_heap_live, info);
-            free(info->frames);
-            free(info->lines_buffer);
-            free(info);
+            if (info->living)
+                info->memsize = get_object_size(info->obj);
+            info->stack->bytes += info->memsize;
         }
+        // Every tracked allocation holds a reference on its stack, so each
+        // distinct stack is recorded once, weighted by its allocations.
+        HASH_ITER(hh, _stackprof.heap_stacks, stack, stack_tmp) {
+            stackprof_process_sample(stack->frames, stack->lines, stack->num, stack->refs);
+            stackprof_add_bytes(stack->frames, stack->num, stack->bytes);
+        }
+        heap_release();
     } else {
 	rb_raise(rb_eArgError, "unknown profiler mode");
     }
+    stackprof_flush_stack();
 
     return Qtrue;
 }
 
-static int
-frame_edges_i(st_data_t key, st_data_t val, st_data_t arg)
+static VALUE
+stackprof_frame_name(VALUE frame)
+{
+    if (frame == FAKE_FRAME_GC)
+	return rb_str_new_cstr("(garbage collection)");
+    if (frame == FAKE_FRAME_MARK)
+	return rb_str_new_cstr("(marking)");
+    if (frame == FAKE_FRAME_SWEEP)
+	return rb_str_new_cstr("(sweeping)");
+    return rb_profile_frame_full_label(frame);
+}
+
+static VALUE
+stackprof_frame_file(VALUE frame)
 {
-    VALUE edges = (VALUE)arg;
+    VALUE file;
 
-    intptr_t weight = (intptr_t)val;
-    rb_hash_aset(edges, rb_obj_id((VALUE)key), INT2FIX(weight));
-    return ST_CONTINUE;
+    if (FAKE_FRAME_P(frame))
+	return rb_str_new_cstr("(gc)");
+    file = rb_profile_frame_absolute_path(frame);
+    if (NIL_P(file))
+	file = rb_profile_frame_path(frame);
+    return file;
 }
 
-static int
-frame_lines_i(st_data_t key, st_data_t val, st_data_t arg)
+static VALUE
+stackprof_frame_line(VALUE frame)
 {
-    VALUE lines = (VALUE)arg;
+    return FAKE_FRAME_P(frame) ? INT2FIX(0) : rb_profile_frame_first_lineno(frame);
+}
 
-    size_t weight = (size_t)val;
-    size_t total = weight & (~(size_t)0 << (8*SIZEOF_SIZE_T/2));
-    weight -= total;
-    total = total >> (8*SIZEOF_SIZE_T/2);
-    rb_hash_aset(lines, INT2FIX(key), rb_ary_new3(2, ULONG2NUM(total), ULONG2NUM(weight)));
-    return ST_CONTINUE;
+/*
+ * Frames are keyed in results by a hash of their name, file and line, not
+ * rb_obj_id, so a frame has the same id in every process and profiles can
+ * be joined on it. Keys are kept within Fixnum range.
+ */
+static inline uint64_t
+stackprof_key_bytes(uint64_t h, const char *ptr, long len)
+{
+    while (len-- > 0) {
+	h ^= (unsigned char)*ptr++;
+	h *= 0x100000001b3ULL;
+    }
+    return h;
 }
 
-static int
-frame_i(st_data_t key, st_data_t val, st_data_t arg)
+static uint64_t
+stackprof_frame_key(VALUE name, VALUE file, VALUE line)
 {
-    VALUE frame = (VALUE)key;
-    frame_data_t *frame_data = (frame_data_t *)val;
-    VALUE results = (VALUE)arg;
-    VALUE details = rb_hash_new();
-    VALUE name, file, edges, lines;
-    VALUE line;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    if (RB_TYPE_P(name, T_STRING))
+	h = stackprof_key_bytes(h, RSTRING_PTR(name), RSTRING_LEN(name));
+    h = stackprof_key_bytes(h, "", 1);
+    if (RB_TYPE_P(file, T_STRING))
+	h = stackprof_key_bytes(h, RSTRING_PTR(file), RSTRING_LEN(file));
+    h = stackprof_key_bytes(h, "", 1);
+    if (FIXNUM_P(line))
+	h ^= (uint64_t)FIX2LONG(line);
+    return stackprof_hash_mix(h * 0x100000001b3ULL) & FIXNUM_MAX;
+}
 
-    rb_hash_aset(results, rb_obj_id(frame), details);
+static inline symbol_t *
+symbol_table_slot(symbol_t *entries, size_t capa, VALUE frame)
+{
+    size_t mask = capa - 1;
+    size_t i = stackprof_hash_mix((uint64_t)frame * 0x9e3779b97f4a7c15ULL) & mask;
 
-    name = rb_profile_frame_full_label(frame);
-    rb_hash_aset(details, sym_name, name);
+    while (entries[i].frame && entries[i].frame != frame)
+	i = (i + 1) & mask;
+    return &entries[i];
+}
 
-    file = rb_profile_frame_absolute_path(frame);
-    if (NIL_P(file))
-	file = rb_profile_frame_path(frame);
-    rb_hash_aset(details, sym_file, file);
+static void
+symbol_table_grow(void)
+{
+    symbol_t *entries = symbols.entries;
+    size_t n, capa = symbols.capa;
+
+    symbols.capa = capa ? capa * 2 : 1024;
+    symbols.entries = calloc(symbols.capa, sizeof(symbol_t));
+    for (n = 0; n < capa; n++)
+	if (entries[n].frame)
+	    *symbol_table_slot(symbols.entries, symbols.capa, entries[n].frame) = entries[n];
+    free(entries);
+}
+
+/* forgets the session's frames, which stop being marked */
+static void
+symbol_table_clear(void)
+{
+    free(symbols.entries);
+    symbols.entries = NULL;
+    symbols.len = symbols.capa = 0;
+    symbols.pending_len = 0;
+    symbols.strings = rb_ary_new3(1, Qnil);
+    symbols.index = rb_hash_new();
+}
+
+static uint32_t symbol_intern(VALUE str);
+
+/*
+ * Cuts the cache down to the frames of +table+, the snapshot being taken,
+ * with their strings renumbered into a fresh string table. Frames only
+ * older snapshots had stop being marked, and the dump's string table only
+ * holds what its own frames use. The snapshot's frames are marked through
+ * detached_profile meanwhile.
+ */
+static void
+symbol_table_retain(frame_table_t *table)
+{
+    symbol_t *entries = symbols.entries;
+    size_t n, capa = symbols.capa;
+    VALUE strings = symbols.strings;
+
+    symbols.entries = NULL;
+    symbols.len = symbols.capa = 0;
+    /* all of them are in the snapshot, whose results resolve them */
+    symbols.pending_len = 0;
+    symbols.strings = rb_ary_new3(1, Qnil);
+    symbols.index = rb_hash_new();
+
+    for (n = 0; capa && n < table->capa; n++) {
+	VALUE frame = table->entries[n].frame;
+	symbol_t *old, *symbol;
+
+	if (!frame || !(old = symbol_table_slot(entries, capa, frame))->frame)
+	    continue;
+	if ((symbols.len + 1) * 2 > symbols.capa)
+	    symbol_table_grow();
+	symbol = symbol_table_slot(symbols.entries, symbols.capa, frame);
+	*symbol = *old;
+	symbol->name = symbol_intern(RARRAY_AREF(strings, old->name));
+	symbol->file = symbol_intern(RARRAY_AREF(strings, old->file));
+	symbols.len++;
+    }
+    free(entries);
+    RB_GC_GUARD(strings);
+}
+
+static uint32_t
+symbol_intern(VALUE str)
+{
+    VALUE n;
+
+    if (NIL_P(str))
+	return 0;
+    if (NIL_P(n = rb_hash_lookup(symbols.index, str))) {
+	str = rb_str_new_frozen(str);
+	n = LONG2FIX(RARRAY_LEN(symbols.strings));
+	rb_ary_push(symbols.strings, str);
+	rb_hash_aset(symbols.index, str, n);
+    }
+    return FIX2UINT(n);
+}
+
+/* resolves +frame+ on first sight; the pointer is valid until the next miss */
+static symbol_t *
+stackprof_symbolize(VALUE frame)
+{
+    symbol_t *symbol;
+    VALUE name, file, line;
+
+    if (symbols.capa && (symbol = symbol_table_slot(symbols.entries, symbols.capa, frame))->frame)
+	return symbol;
+
+    name = stackprof_frame_name(frame);
+    file = stackprof_frame_file(frame);
+    line = stackprof_frame_line(frame);
+
+    /* keep the table at most half full */
+    if ((symbols.len + 1) * 2 > symbols.capa)
+	symbol_table_grow();
+    symbol = symbol_table_slot(symbols.entries, symbols.capa, frame);
+    symbol->name = symbol_intern(name);
+    symbol->file = symbol_intern(file);
+    symbol->line = line;
+    symbol->key = stackprof_frame_key(name, file, line);
+    symbol->frame = frame;
+    symbols.len++;
+    return symbol;
+}
+
+static inline VALUE
+symbol_string(uint32_t index)
+{
+    return RARRAY_AREF(symbols.strings, index);
+}
+
+#define SYMBOLIZE_BATCH 64
+
+/*
+ * With symbolize: true, frames are resolved a batch at a time as they're
+ * first sampled, between samples, so that results and snapshots find most
+ * of them already done and hold the GVL for less.
+ */
+static void
+stackprof_job_symbolize(void *data)
+{
+    int n;
+
+    _stackprof.symbolizing = 1;
+    for (n = 0; n < SYMBOLIZE_BATCH && symbols.pending_len; n++)
+	stackprof_symbolize(symbols.pending[--symbols.pending_len]);
+    _stackprof.symbolizing = 0;
+    if (symbols.pending_len)
+	stackprof_trigger_job(JOB_SYMBOLIZE);
+}
+
+static void
+stackprof_symbolize_later(VALUE frame)
+{
+    if (symbols.pending_len == symbols.pending_capa) {
+	symbols.pending_capa = symbols.pending_capa ? symbols.pending_capa * 2 : 256;
+	symbols.pending = realloc(symbols.pending, symbols.pending_capa * sizeof(VALUE));
+    }
+    symbols.pending[symbols.pending_len++] = frame;
+    if (symbols.pending_len == 1)
+	stackprof_trigger_job(JOB_SYMBOLIZE);
+}
+
+static void
+frame_data_fold(frame_data_t *into, frame_data_t *from)
+{
+    unsigned int n;
+
+    into->total_samples += from->total_samples;
+    into->caller_samples += from->caller_samples;
+    for (n = 0; n < from->edges_len; n++)
+	frame_data_edge_increment(into, from->edges[n].frame, from->edges[n].weight);
+    for (n = 0; n < from->lines_len; n++)
+	frame_data_line_increment(into, from->lines[n].line, from->lines[n].total_samples, from->lines[n].caller_samples);
+    if (from->states) {
+	if (!into->states)
+	    into->states = calloc(2 * STATE_COUNT, sizeof(size_t));
+	for (n = 0; n < 2 * STATE_COUNT; n++)
+	    into->states[n] += from->states[n];
+    }
+    if (from->bytes) {
+	if (!into->bytes)
+	    into->bytes = calloc(2, sizeof(size_t));
+	into->bytes[0] += from->bytes[0];
+	into->bytes[1] += from->bytes[1];
+    }
+    frame_data_free(from);
+    from->edges_len = from->edges_capa = 0;
+    from->lines_len = from->lines_capa = 0;
+}
+
+static inline frame_data_t *
+frame_table_find(frame_table_t *table, VALUE frame)
+{
+    return &frame_table_slot(table->entries, table->capa, frame)->data;
+}
+
+/*
+ * Gives every frame of the table its key, once, before results are
+ * written, symbolizing the ones that aren't yet. Frames that share a key
+ * (the same method loaded twice) are folded into the first of them, and
+ * edges to the others redirected. Returns the number of frames left.
+ */
+static size_t
+stackprof_key_frames(frame_table_t *table)
+{
+    st_table *keys = st_init_numtable();
+    size_t n, folded = 0;
+    unsigned int i;
+
+    for (n = 0; n < table->capa; n++) {
+	frame_entry_t *entry = &table->entries[n];
+	st_data_t first;
+
+	if (!entry->frame)
+	    continue;
+	entry->data.key = stackprof_symbolize(entry->frame)->key;
+	entry->data.canonical = entry->frame;
+	if (st_lookup(keys, (st_data_t)entry->data.key, &first)) {
+	    entry->data.canonical = (VALUE)first;
+	    frame_data_fold(frame_table_find(table, (VALUE)first), &entry->data);
+	    folded++;
+	} else {
+	    st_insert(keys, (st_data_t)entry->data.key, (st_data_t)entry->frame);
+	}
+    }
+    st_free_table(keys);
+
+    if (folded) {
+	for (n = 0; n < table->capa; n++) {
+	    frame_data_t *frame_data = &table->entries[n].data;
+	    frame_edge_t *edges = frame_data->edges;
+	    unsigned int edges_len = frame_data->edges_len;
+
+	    if (!table->entries[n].frame || !edges_len)
+		continue;
+	    frame_data->edges = NULL;
+	    frame_data->edges_len = frame_data->edges_capa = 0;
+	    for (i = 0; i < edges_len; i++)
+		frame_data_edge_increment(frame_data, frame_table_find(table, edges[i].frame)->canonical, edges[i].weight);
+	    free(edges);
+	}
+    }
+
+    return table->len - folded;
+}
+
+static VALUE
+stackprof_frame_id(VALUE frame, void *table)
+{
+    return ULL2NUM(frame_table_find((frame_table_t *)table, frame)->key);
+}
 
-    if ((line = rb_profile_frame_first_lineno(frame)) != INT2FIX(0))
-	rb_hash_aset(details, sym_line, line);
+/* the counts of a frame; +frame_id+ turns a callee into its key in :edges */
+static void
+frame_details(VALUE details, frame_data_t *frame_data, VALUE (*frame_id)(VALUE, void *), void *arg)
+{
+    VALUE edges, lines;
+    unsigned int n;
 
     rb_hash_aset(details, sym_total_samples, SIZET2NUM(frame_data->total_samples));
     rb_hash_aset(details, sym_samples, SIZET2NUM(frame_data->caller_samples));
 
-    if (frame_data->edges) {
-        edges = rb_hash_new();
-        rb_hash_aset(details, sym_edges, edges);
-        st_foreach(frame_data->edges, frame_edges_i, (st_data_t)edges);
-        st_free_table(frame_data->edges);
-        frame_data->edges = NULL;
+    if (frame_data->bytes) {
+	rb_hash_aset(details, sym_total_bytes, SIZET2NUM(frame_data->bytes[0]));
+	rb_hash_aset(details, sym_bytes, SIZET2NUM(frame_data->bytes[1]));
+    }
+
+    if (frame_data->states) {
+	VALUE states = rb_hash_new();
+	rb_hash_aset(details, sym_states, states);
+	for (n = 0; n < STATE_COUNT; n++)
+	    if (frame_data->states[2*n])
+		rb_hash_aset(states, sym_state_names[n], rb_ary_new3(2, SIZET2NUM(frame_data->states[2*n]), SIZET2NUM(frame_data->states[2*n+1])));
+    }
+
+    if (frame_data->edges_len) {
+	edges = rb_hash_new();
+	rb_hash_aset(details, sym_edges, edges);
+	for (n = 0; n < frame_data->edges_len; n++)
+	    rb_hash_aset(edges, frame_id(frame_data->edges[n].frame, arg), SIZET2NUM(frame_data->edges[n].weight));
     }
 
-    if (frame_data->lines) {
+    if (frame_data->lines_len) {
 	lines = rb_hash_new();
 	rb_hash_aset(details, sym_lines, lines);
-	st_foreach(frame_data->lines, frame_lines_i, (st_data_t)lines);
-	st_free_table(frame_data->lines);
-	frame_data->lines = NULL;
+	for (n = 0; n < frame_data->lines_len; n++) {
+	    frame_line_t *line = &frame_data->lines[n];
+	    rb_hash_aset(lines, INT2FIX(line->line), rb_ary_new3(2, ULL2NUM(line->total_samples), ULL2NUM(line->caller_samples)));
+	}
     }
+}
+
+static void
+frame_i(frame_data_t *frame_data, symbol_t *symbol, frame_table_t *table, VALUE results)
+{
+    VALUE details = rb_hash_new();
+
+    rb_hash_aset(results, ULL2NUM(frame_data->key), details);
+    rb_hash_aset(details, sym_name, symbol_string(symbol->name));
+    rb_hash_aset(details, sym_file, symbol_string(symbol->file));
+    if (symbol->line != INT2FIX(0))
+	rb_hash_aset(details, sym_line, symbol->line);
 
-    xfree(frame_data);
-    return ST_DELETE;
+    frame_details(details, frame_data, stackprof_frame_id, table);
 }
 
-static VALUE
-stackprof_results(int argc, VALUE *argv, VALUE self)
+/*
+ * Moves the collected profile out of _stackprof into +profile+ and resets
+ * the counters. Callers hold the GVL, so no postponed job can be midway
+ * through a sample; the signal handler only touches the counters, which are
+ * swapped atomically.
+ */
+static void
+stackprof_detach_profile(profile_t *profile)
 {
-    VALUE results, frames;
+    stackprof_flush_stack();
+    profile->raw = _stackprof.raw;
+    profile->states = _stackprof.track_states;
+    profile->bytes = _stackprof.track_bytes;
+    profile->timestamps = _stackprof.timestamps;
+    profile->start_timestamp = _stackprof.start_timestamp;
+    profile->start_time = _stackprof.start_time;
+    profile->pid = _stackprof.follow_fork ? _stackprof.pid : 0;
+    memcpy(profile->state_samples, _stackprof.state_samples, sizeof(profile->state_samples));
+    memset(_stackprof.state_samples, 0, sizeof(_stackprof.state_samples));
+    profile->frames = _stackprof.frames;
+    _stackprof.frames = NULL;
 
-    if (!_stackprof.frames || _stackprof.running)
-	return Qnil;
+    profile->threads = _stackprof.threads;
+    profile->threads_len = _stackprof.threads_len;
+    _stackprof.threads = NULL;
+    _stackprof.threads_len = 0;
+    _stackprof.threads_capa = 0;
+
+    profile->tag_samples = _stackprof.tag_samples;
+    profile->tag_samples_len = _stackprof.tag_samples_len;
+    _stackprof.tag_samples = NULL;
+    _stackprof.tag_samples_len = 0;
+
+    profile->raw_nodes = _stackprof.raw_nodes;
+    profile->raw_nodes_len = _stackprof.raw_nodes_len;
+    _stackprof.raw_nodes = NULL;
+    _stackprof.raw_nodes_len = 0;
+    _stackprof.raw_nodes_capa = 0;
+    free(_stackprof.raw_nodes_index);
+    _stackprof.raw_nodes_index = NULL;
+    _stackprof.raw_nodes_index_capa = 0;
+
+    profile->raw_samples = _stackprof.raw_samples;
+    profile->raw_samples_len = _stackprof.raw_samples_len;
+    _stackprof.raw_samples = NULL;
+    _stackprof.raw_samples_len = 0;
+    _stackprof.raw_samples_capa = 0;
+
+    profile->overall_signals = __atomic_exchange_n(&_stackprof.overall_signals, 0, __ATOMIC_ACQ_REL);
+    profile->overall_samples = __atomic_exchange_n(&_stackprof.overall_samples, 0, __ATOMIC_ACQ_REL);
+    profile->during_gc = __atomic_exchange_n(&_stackprof.during_gc, 0, __ATOMIC_ACQ_REL);
+
+    profile->interval_history = _stackprof.interval_history;
+    profile->interval_history_len = _stackprof.interval_history_len;
+    _stackprof.interval_history = NULL;
+    _stackprof.interval_history_len = 0;
+    _stackprof.interval_history_capa = 0;
+}
+
+static void
+stackprof_free_profile(profile_t *profile)
+{
+    if (profile->frames)
+	frame_table_free(profile->frames);
+    free(profile->raw_nodes);
+    free(profile->raw_samples);
+    free(profile->threads);
+    free(profile->tag_samples);
+    free(profile->interval_history);
+}
 
-    results = rb_hash_new();
-    rb_hash_aset(results, sym_version, DBL2NUM(1.1));
+static VALUE
+stackprof_results_meta(profile_t *profile)
+{
+    VALUE results = rb_hash_new();
+
+    rb_hash_aset(results, sym_version, DBL2NUM(RESULTS_VERSION));
     rb_hash_aset(results, sym_mode, _stackprof.mode);
     rb_hash_aset(results, sym_interval, _stackprof.interval);
-    rb_hash_aset(results, sym_samples, SIZET2NUM(_stackprof.overall_samples));
-    rb_hash_aset(results, sym_gc_samples, SIZET2NUM(_stackprof.during_gc));
-    rb_hash_aset(results, sym_missed_samples, SIZET2NUM(_stackprof.overall_signals - _stackprof.overall_samples));
+    rb_hash_aset(results, sym_samples, SIZET2NUM(profile->overall_samples));
+    rb_hash_aset(results, sym_gc_samples, SIZET2NUM(profile->during_gc));
+    rb_hash_aset(results, sym_missed_samples, SIZET2NUM(profile->overall_signals - profile->overall_samples));
+    if (profile->pid)
+	rb_hash_aset(results, sym_pid, INT2NUM(profile->pid));
+
+    if (profile->timestamps) {
+	rb_hash_aset(results, sym_raw_start_timestamp, ULL2NUM(profile->start_timestamp / 1000));
+	rb_hash_aset(results, sym_raw_start_time, DBL2NUM(profile->start_time));
+    }
 
-    frames = rb_hash_new();
-    rb_hash_aset(results, sym_frames, frames);
-    st_foreach(_stackprof.frames, frame_i, (st_data_t)frames);
+    if (profile->interval_history_len) {
+	VALUE history = rb_ary_new_capa(profile->interval_history_len);
+	size_t n;
 
-    st_free_table(_stackprof.frames);
-    _stackprof.frames = NULL;
+	rb_hash_aset(results, sym_interval_history, history);
+	for (n = 0; n < profile->interval_history_len; n++)
+	    rb_ary_push(history, rb_assoc_new(SIZET2NUM(profile->interval_history[n].samples),
+		LONG2NUM(profile->interval_history[n].interval)));
+    }
+
+    if (profile->states) {
+	VALUE states = rb_hash_new();
+	int n;
+
+	rb_hash_aset(results, sym_states, states);
+	for (n = 0; n < STATE_COUNT; n++)
+	    rb_hash_aset(states, sym_state_names[n], SIZET2NUM(n == STATE_GC ? profile->during_gc : profile->state_samples[n]));
+    }
+
+    if (profile->threads_len) {
+	VALUE threads = rb_hash_new();
+	size_t n;
+
+	rb_hash_aset(results, sym_threads, threads);
+	for (n = 0; n < profile->threads_len; n++) {
+	    sample_thread_t *entry = &profile->threads[n];
+	    VALUE details = rb_hash_new();
+
+	    rb_hash_aset(threads, SIZET2NUM(n + 1), details);
+	    if (RTEST(entry->thread)) {
+		rb_hash_aset(details, sym_thread_id, rb_obj_id(entry->thread));
+		rb_hash_aset(details, sym_name, rb_funcall(entry->thread, rb_intern("name"), 0));
+	    }
+	    if (RTEST(entry->fiber))
+		rb_hash_aset(details, sym_fiber_id, rb_obj_id(entry->fiber));
+	    if (entry->tid)
+		rb_hash_aset(details, sym_native_thread_id, UINT2NUM(entry->tid));
+	    rb_hash_aset(details, sym_samples, SIZET2NUM(entry->samples));
+	}
+    }
+
+    if (profile->tag_samples_len) {
+	VALUE tags = rb_hash_new();
+	size_t n;
+
+	rb_hash_aset(results, sym_tags, tags);
+	for (n = 0; n < profile->tag_samples_len; n++) {
+	    VALUE details;
+
+	    if (!profile->tag_samples[n])
+		continue;
+	    details = rb_hash_new();
+	    rb_hash_aset(tags, SIZET2NUM(n + 1), details);
+	    rb_hash_aset(details, sym_name, RARRAY_AREF(tag_names, n));
+	    rb_hash_aset(details, sym_samples, SIZET2NUM(profile->tag_samples[n]));
+	}
+    }
+
+    return results;
+}
+
+/*
+ * Binary dump format, written straight from the profiler's tables.
+ *
+ * After the 8 byte magic the file is a sequence of sections, each a 4 byte
+ * tag, 4 reserved bytes, the payload length as a u64 and the payload. All
+ * integers are little-endian. Readers skip sections they don't know.
+ *
+ *   META  Marshal'd hash of the scalar results (mode, interval, samples...)
+ *   STRS  u64 count, then count times u32 length + bytes; index 0 is nil.
+ *         Holds the names and files of the dump's own frames, plus at most
+ *         a few of frames already sampled into the next snapshot; indexes
+ *         are only meaningful within one dump
+ *   FRMS  u64 count, then per frame 10 u64s: id, name, file, line, total
+ *         samples, samples, first edge, edge count, first line, line count
+ *   EDGS  u64 count, then per edge 2 u64s: callee frame id, weight
+ *   LINS  u64 count, then per line 3 u64s: line, total samples, samples
+ *   STAT  u64 count, then per frame (in FRMS order) total and self samples
+ *         as u64s for each of running, gvl_wait, blocked, gc (states only)
+ *   BYTS  u64 count, then per frame (in FRMS order) total and self bytes as
+ *         u64s (object and heap mode only)
+ *   NODS  u64 count, then per raw stack node 2 u64s: parent node, frame id
+ *   SMPL  u64 count, then per raw sample 2 u32s: node, weight
+ *   THRD  u64 count, then per raw sample the u32 index into the :threads
+ *         table of META (threads or per_thread profiles only)
+ *   TAGS  u64 count, then per raw sample the u32 index into the :tags table
+ *         of META, 0 if untagged (only once a sample was tagged)
+ *   TMST  u64 count, then per raw sample the u32 usecs since the previous
+ *         one, the first since :raw_start_timestamp (timestamps only)
+ */
+#define DUMP_MAGIC "STACKPRF"
+#define DUMP_BUFFER_SIZE (64 * 1024)
+
+/* one per dump: rb_io_write can switch threads, and another dump start */
+typedef struct {
+    VALUE io;
+    size_t len;
+    char *buf; /* DUMP_BUFFER_SIZE bytes */
+} dump_writer_t;
+
+static void
+dump_flush(dump_writer_t *writer)
+{
+    if (writer->len) {
+	rb_io_write(writer->io, rb_str_new(writer->buf, writer->len));
+	writer->len = 0;
+    }
+}
+
+static void
+dump_write(dump_writer_t *writer, const void *data, size_t len)
+{
+    if (writer->len + len > DUMP_BUFFER_SIZE)
+	dump_flush(writer);
+    if (len > DUMP_BUFFER_SIZE) {
+	rb_io_write(writer->io, rb_str_new(data, len));
+    } else {
+	memcpy(writer->buf + writer->len, data, len);
+	writer->len += len;
+    }
+}
+
+static void
+dump_u32(dump_writer_t *writer, uint32_t val)
+{
+    unsigned char bytes[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+	bytes[i] = (unsigned char)(val >> (8*i));
+    dump_write(writer, bytes, 4);
+}
+
+static void
+dump_u64(dump_writer_t *writer, uint64_t val)
+{
+    unsigned char bytes[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+	bytes[i] = (unsigned char)(val >> (8*i));
+    dump_write(writer, bytes, 8);
+}
+
+static void
+dump_section(dump_writer_t *writer, const char *tag, uint64_t len)
+{
+    dump_write(writer, tag, 4);
+    dump_u32(writer, 0);
+    dump_u64(writer, len);
+}
+
+static inline uint64_t
+dump_frame_id(frame_table_t *table, VALUE frame)
+{
+    return frame_table_find(table, frame)->key;
+}
+
+/* folded frames' counts moved to the frame sharing their key */
+#define DUMP_FRAME_P(entry) ((entry)->frame && (entry)->data.canonical == (entry)->frame)
+
+static void
+stackprof_dump_binary(VALUE io, profile_t *profile)
+{
+    dump_writer_t dump_writer, *writer = &dump_writer;
+    frame_table_t *table = profile->frames;
+    VALUE strings, meta, buf, labels_buf;
+    uint64_t edges_len = 0, lines_len = 0, strings_size = 8, *labels;
+    size_t n, f, frames_len;
+    unsigned int i;
+    long s, strings_len;
+
+    writer->io = io;
+    writer->len = 0;
+    writer->buf = ALLOCV(buf, DUMP_BUFFER_SIZE);
+
+    /*
+     * resolve every frame first so the string table can be written up
+     * front. Writing can run symbolize jobs, or let another thread take
+     * results and clear the table, so what the dump refers to is copied out
+     * before anything is written: its length, and each frame's name, file
+     * and line
+     */
+    frames_len = stackprof_key_frames(table);
+    labels = ALLOCV_N(uint64_t, labels_buf, 3 * frames_len + 1);
+    for (n = 0, f = 0; n < table->capa; n++) {
+	symbol_t *symbol;
+
+	if (!DUMP_FRAME_P(&table->entries[n]))
+	    continue;
+	symbol = stackprof_symbolize(table->entries[n].frame);
+	labels[3*f] = symbol->name;
+	labels[3*f+1] = symbol->file;
+	labels[3*f+2] = NIL_P(symbol->line) ? 0 : NUM2ULL(symbol->line);
+	edges_len += table->entries[n].data.edges_len;
+	lines_len += table->entries[n].data.lines_len;
+	f++;
+    }
+    strings = symbols.strings;
+    strings_len = RARRAY_LEN(strings);
+    for (s = 1; s < strings_len; s++)
+	strings_size += 4 + RSTRING_LEN(RARRAY_AREF(strings, s));
+
+    dump_write(writer, DUMP_MAGIC, 8);
+
+    meta = rb_marshal_dump(stackprof_results_meta(profile), Qnil);
+    dump_section(writer, "META", RSTRING_LEN(meta));
+    dump_write(writer, RSTRING_PTR(meta), RSTRING_LEN(meta));
+
+    dump_section(writer, "STRS", strings_size);
+    dump_u64(writer, strings_len - 1);
+    for (s = 1; s < strings_len; s++) {
+	VALUE str = RARRAY_AREF(strings, s);
+	dump_u32(writer, (uint32_t)RSTRING_LEN(str));
+	dump_write(writer, RSTRING_PTR(str), RSTRING_LEN(str));
+    }
+
+    dump_section(writer, "FRMS", 8 + 80 * (uint64_t)frames_len);
+    dump_u64(writer, frames_len);
+    edges_len = lines_len = 0;
+    for (n = 0, f = 0; n < table->capa; n++) {
+	frame_entry_t *entry = &table->entries[n];
+
+	if (!DUMP_FRAME_P(entry))
+	    continue;
+	dump_u64(writer, entry->data.key);
+	dump_u64(writer, labels[3*f]);
+	dump_u64(writer, labels[3*f+1]);
+	dump_u64(writer, labels[3*f+2]);
+	f++;
+	dump_u64(writer, entry->data.total_samples);
+	dump_u64(writer, entry->data.caller_samples);
+	dump_u64(writer, edges_len);
+	dump_u64(writer, entry->data.edges_len);
+	dump_u64(writer, lines_len);
+	dump_u64(writer, entry->data.lines_len);
+	edges_len += entry->data.edges_len;
+	lines_len += entry->data.lines_len;
+    }
+
+    dump_section(writer, "EDGS", 8 + 16 * edges_len);
+    dump_u64(writer, edges_len);
+    for (n = 0; n < table->capa; n++) {
+	frame_data_t *frame_data = &table->entries[n].data;
+
+	if (!DUMP_FRAME_P(&table->entries[n]))
+	    continue;
+	for (i = 0; i < frame_data->edges_len; i++) {
+	    dump_u64(writer, dump_frame_id(table, frame_data->edges[i].frame));
+	    dump_u64(writer, frame_data->edges[i].weight);
+	}
+    }
+
+    dump_section(writer, "LINS", 8 + 24 * lines_len);
+    dump_u64(writer, lines_len);
+    for (n = 0; n < table->capa; n++) {
+	frame_data_t *frame_data = &table->entries[n].data;
+
+	if (!DUMP_FRAME_P(&table->entries[n]))
+	    continue;
+	for (i = 0; i < frame_data->lines_len; i++) {
+	    dump_u64(writer, frame_data->lines[i].line);
+	    dump_u64(writer, frame_data->lines[i].total_samples);
+	    dump_u64(writer, frame_data->lines[i].caller_samples);
+	}
+    }
+
+    if (profile->states) {
+	dump_section(writer, "STAT", 8 + 16 * STATE_COUNT * (uint64_t)frames_len);
+	dump_u64(writer, frames_len);
+	for (n = 0; n < table->capa; n++) {
+	    frame_data_t *frame_data = &table->entries[n].data;
 
-    if (_stackprof.raw && _stackprof.raw_samples_len) {
-	size_t len, n, o;
-	VALUE raw_samples = rb_ary_new_capa(_stackprof.raw_samples_len);
+	    if (!DUMP_FRAME_P(&table->entries[n]))
+		continue;
+	    for (i = 0; i < 2 * STATE_COUNT; i++)
+		dump_u64(writer, frame_data->states ? frame_data->states[i] : 0);
+	}
+    }
+
+    if (profile->bytes) {
+	dump_section(writer, "BYTS", 8 + 16 * (uint64_t)frames_len);
+	dump_u64(writer, frames_len);
+	for (n = 0; n < table->capa; n++) {
+	    frame_data_t *frame_data = &table->entries[n].data;
+
+	    if (!DUMP_FRAME_P(&table->entries[n]))
+		continue;
+	    dump_u64(writer, frame_data->bytes ? frame_data->bytes[0] : 0);
+	    dump_u64(writer, frame_data->bytes ? frame_data->bytes[1] : 0);
+	}
+    }
+
+    if (profile->raw && profile->raw_samples_len) {
+	dump_section(writer, "NODS", 8 + 16 * (uint64_t)(profile->raw_nodes_len - 1));
+	dump_u64(writer, profile->raw_nodes_len - 1);
+	for (n = 1; n < profile->raw_nodes_len; n++) {
+	    dump_u64(writer, profile->raw_nodes[n].parent);
+	    dump_u64(writer, dump_frame_id(table, profile->raw_nodes[n].frame));
+	}
 
-	for (n = 0; n < _stackprof.raw_samples_len; n++) {
-	    len = (size_t)_stackprof.raw_samples[n];
-	    rb_ary_push(raw_samples, SIZET2NUM(len));
+	dump_section(writer, "SMPL", 8 + 8 * (uint64_t)profile->raw_samples_len);
+	dump_u64(writer, profile->raw_samples_len);
+	for (n = 0; n < profile->raw_samples_len; n++) {
+	    dump_u32(writer, profile->raw_samples[n].node);
+	    dump_u32(writer, profile->raw_samples[n].weight);
+	}
+
+	if (profile->threads_len) {
+	    dump_section(writer, "THRD", 8 + 4 * (uint64_t)profile->raw_samples_len);
+	    dump_u64(writer, profile->raw_samples_len);
+	    for (n = 0; n < profile->raw_samples_len; n++)
+		dump_u32(writer, profile->raw_samples[n].thread);
+	}
+
+	if (profile->tag_samples_len) {
+	    dump_section(writer, "TAGS", 8 + 4 * (uint64_t)profile->raw_samples_len);
+	    dump_u64(writer, profile->raw_samples_len);
+	    for (n = 0; n < profile->raw_samples_len; n++)
+		dump_u32(writer, profile->raw_samples[n].tag);
+	}
 
-	    for (o = 0, n++; o < len; n++, o++)
-		rb_ary_push(raw_samples, rb_obj_id(_stackprof.raw_samples[n]));
-	    rb_ary_push(raw_samples, SIZET2NUM((size_t)_stackprof.raw_samples[n]));
+	if (profile->timestamps) {
+	    dump_section(writer, "TMST", 8 + 4 * (uint64_t)profile->raw_samples_len);
+	    dump_u64(writer, profile->raw_samples_len);
+	    for (n = 0; n < profile->raw_samples_len; n++)
+		dump_u32(writer, profile->raw_samples[n].delta);
 	}
+    }
+
+    dump_flush(writer);
+    ALLOCV_END(labels_buf);
+    ALLOCV_END(buf);
+    RB_GC_GUARD(strings);
+    RB_GC_GUARD(io);
+}
 
-	free(_stackprof.raw_samples);
-	_stackprof.raw_samples = NULL;
-	_stackprof.raw_samples_len = 0;
-	_stackprof.raw_samples_capa = 0;
-	_stackprof.raw_sample_index = 0;
-	_stackprof.raw = 0;
+static VALUE
+stackprof_open_out(void)
+{
+    /* every worker of a preforked fleet writes its own file */
+    if (RB_TYPE_P(_stackprof.out, T_STRING) && _stackprof.forked)
+	return rb_file_open_str(rb_sprintf("%"PRIsVALUE".%d", _stackprof.out, (int)_stackprof.pid), "wb");
+    if (RB_TYPE_P(_stackprof.out, T_STRING))
+	return rb_file_open_str(_stackprof.out, "wb");
+    return rb_io_check_io(_stackprof.out);
+}
+
+static VALUE
+stackprof_profile_results(profile_t *profile)
+{
+    VALUE results, frames;
+    size_t n;
+
+    if (RTEST(_stackprof.out) && _stackprof.format == sym_binary) {
+	VALUE file = stackprof_open_out();
+	stackprof_dump_binary(file, profile);
+	rb_io_flush(file);
+	_stackprof.out = Qnil;
+	return file;
+    }
+
+    results = stackprof_results_meta(profile);
+
+    stackprof_key_frames(profile->frames);
+    frames = rb_hash_new();
+    rb_hash_aset(results, sym_frames, frames);
+    for (n = 0; n < profile->frames->capa; n++) {
+	frame_entry_t *entry = &profile->frames->entries[n];
+
+	if (entry->frame && entry->data.canonical == entry->frame)
+	    frame_i(&entry->data, stackprof_symbolize(entry->frame), profile->frames, frames);
+    }
+
+    if (profile->raw && profile->raw_samples_len) {
+	VALUE raw_nodes = rb_ary_new_capa(2 * (profile->raw_nodes_len - 1));
+	VALUE raw_samples = rb_ary_new_capa(2 * profile->raw_samples_len);
+
+	/* node n lives at raw_nodes[2*(n-1)] (parent) and raw_nodes[2*(n-1)+1] (frame) */
+	for (n = 1; n < profile->raw_nodes_len; n++) {
+	    rb_ary_push(raw_nodes, UINT2NUM(profile->raw_nodes[n].parent));
+	    rb_ary_push(raw_nodes, stackprof_frame_id(profile->raw_nodes[n].frame, profile->frames));
+	}
+
+	for (n = 0; n < profile->raw_samples_len; n++) {
+	    rb_ary_push(raw_samples, UINT2NUM(profile->raw_samples[n].node));
+	    rb_ary_push(raw_samples, UINT2NUM(profile->raw_samples[n].weight));
+	}
+
+	rb_hash_aset(results, sym_raw_nodes, raw_nodes);
+	rb_hash_aset(results, sym_raw_samples, raw_samples);
+
+	if (profile->threads_len) {
+	    VALUE threads = rb_ary_new_capa(profile->raw_samples_len);
+	    for (n = 0; n < profile->raw_samples_len; n++)
+		rb_ary_push(threads, UINT2NUM(profile->raw_samples[n].thread));
+	    rb_hash_aset(results, sym_raw_sample_threads, threads);
+	}
+
+	if (profile->tag_samples_len) {
+	    VALUE tags = rb_ary_new_capa(profile->raw_samples_len);
+	    for (n = 0; n < profile->raw_samples_len; n++)
+		rb_ary_push(tags, UINT2NUM(profile->raw_samples[n].tag));
+	    rb_hash_aset(results, sym_raw_sample_tags, tags);
+	}
+
+	if (profile->timestamps) {
+	    VALUE deltas = rb_ary_new_capa(profile->raw_samples_len);
+	    for (n = 0; n < profile->raw_samples_len; n++)
+		rb_ary_push(deltas, UINT2NUM(profile->raw_samples[n].delta));
+	    rb_hash_aset(results, sym_raw_timestamp_deltas, deltas);
+	}
+    }
+
+    if (RTEST(_stackprof.out)) {
+	VALUE file = stackprof_open_out();
+	rb_marshal_dump(results, file);
+	rb_io_flush(file);
+	_stackprof.out = Qnil;
+	return file;
+    } else {
+	return results;
+    }
+}
+
+static VALUE
+stackprof_profile_results_i(VALUE arg)
+{
+    return stackprof_profile_results((profile_t *)arg);
+}
+
+static VALUE
+stackprof_profile_release(VALUE arg)
+{
+    profile_t *profile = (profile_t *)arg;
+
+    stackprof_free_profile(profile);
+    detached_profile = NULL;
+    return Qnil;
+}
+
+/* builds the results off a detached profile, keeping its frames marked until done */
+static VALUE
+stackprof_detached_results(void)
+{
+    profile_t profile;
+
+    stackprof_detach_profile(&profile);
+    detached_profile = &profile;
+    return rb_ensure(stackprof_profile_results_i, (VALUE)&profile, stackprof_profile_release, (VALUE)&profile);
+}
+
+static VALUE
+stackprof_results(int argc, VALUE *argv, VALUE self)
+{
+    VALUE results;
+
+    if (!_stackprof.frames || _stackprof.running)
+	return Qnil;
+
+    if (argc == 1)
+	_stackprof.out = argv[0];
+
+    results = stackprof_detached_results();
+    _stackprof.raw = 0;
+    /* the session is over; snapshots kept its frames resolved until now */
+    symbol_table_clear();
+    return results;
+}
+
+/*
+ * Hands back everything collected so far, like StackProf.results, without
+ * stopping the profiler: sampling carries on into fresh tables. Takes an
+ * optional io or path to write the snapshot to, in the profiler's format.
+ */
+static VALUE
+stackprof_snapshot(int argc, VALUE *argv, VALUE self)
+{
+    VALUE out = _stackprof.out, results;
+    profile_t profile;
+
+    if (!_stackprof.running)
+	return stackprof_results(argc, argv, self);
+    if (_stackprof.mode == sym_heap)
+	rb_raise(rb_eRuntimeError, "heap profiles can't be snapshotted while running");
+
+    rb_check_arity(argc, 0, 1);
+    if (argc == 1)
+	_stackprof.out = argv[0];
+
+    /* samples still sitting in the ring belong to this snapshot */
+    if (_stackprof.ring)
+	stackprof_drain_ring();
+    if (_stackprof.unrecorded_gc_samples)
+	stackprof_record_gc_samples();
+    if (_stackprof.pending_sizes_len)
+	stackprof_measure_pending_sizes();
+    if (_stackprof.mode == sym_object)
+	stackprof_count_allocations();
+
+    stackprof_detach_profile(&profile);
+    _stackprof.frames = frame_table_new(1024);
+    stackprof_reset_clock();
+    if (_stackprof.overhead)
+	stackprof_push_interval(NUM2LONG(_stackprof.interval) * _stackprof.interval_scale);
+    detached_profile = &profile;
+    symbol_table_retain(profile.frames);
+    results = rb_ensure(stackprof_profile_results_i, (VALUE)&profile, stackprof_profile_release, (VALUE)&profile);
+
+    /* writing clears out; the next snapshot goes to the same place */
+    _stackprof.out = out;
+    return results;
+}
+
+static VALUE
+stackprof_run(int argc, VALUE *argv, VALUE self)
+{
+    rb_need_block();
+    stackprof_start(argc, argv, self);
+    rb_ensure(rb_yield, Qundef, stackprof_stop, self);
+    return stackprof_results(0, 0, self);
+}
+
+static VALUE
+stackprof_running_p(VALUE self)
+{
+    return _stackprof.running ? Qtrue : Qfalse;
+}
+
+/*
+ * The profiler's own bookkeeping, cheap enough to scrape from a running
+ * profiler: sample counts of the profile being collected, the time spent
+ * in and the jobs lost by the sampling jobs since the profile began, and
+ * the size of the tables. Times are in ns, sizes in bytes.
+ */
+static VALUE
+stackprof_stats(VALUE self)
+{
+    VALUE stats = rb_hash_new();
+    size_t signals = __atomic_load_n(&_stackprof.overall_signals, __ATOMIC_RELAXED);
+    size_t samples = __atomic_load_n(&_stackprof.overall_samples, __ATOMIC_RELAXED);
+    size_t frames = _stackprof.frames ? _stackprof.frames->len : 0;
+    size_t frames_capa = _stackprof.frames ? _stackprof.frames->capa : 0;
+
+    rb_hash_aset(stats, sym_running, _stackprof.running ? Qtrue : Qfalse);
+    rb_hash_aset(stats, sym_mode, _stackprof.mode ? _stackprof.mode : Qnil);
+    rb_hash_aset(stats, sym_signals, SIZET2NUM(signals));
+    rb_hash_aset(stats, sym_samples, SIZET2NUM(samples));
+    rb_hash_aset(stats, sym_missed_samples, SIZET2NUM(signals > samples ? signals - samples : 0));
+    rb_hash_aset(stats, sym_gc_samples, SIZET2NUM(__atomic_load_n(&_stackprof.during_gc, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, sym_jobs, SIZET2NUM(_stackprof.jobs));
+    rb_hash_aset(stats, sym_job_time_ns, ULL2NUM(_stackprof.job_time));
+    rb_hash_aset(stats, sym_job_register_failures, SIZET2NUM(__atomic_load_n(&_stackprof.job_register_failures, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, sym_reentrant_drops, SIZET2NUM(_stackprof.reentrant_drops));
+    rb_hash_aset(stats, sym_ring_overflows, SIZET2NUM(__atomic_load_n(&_stackprof.ring_overflows, __ATOMIC_RELAXED)));
+    rb_hash_aset(stats, sym_symbols, SIZET2NUM(symbols.len));
+    rb_hash_aset(stats, sym_symbols_pending, SIZET2NUM(symbols.pending_len));
+    rb_hash_aset(stats, sym_frames, SIZET2NUM(frames));
+    rb_hash_aset(stats, sym_frames_capa, SIZET2NUM(frames_capa));
+    rb_hash_aset(stats, sym_frames_load, DBL2NUM(frames_capa ? (double)frames / frames_capa : 0.0));
+    rb_hash_aset(stats, sym_raw_nodes, SIZET2NUM(_stackprof.raw_nodes_len));
+    rb_hash_aset(stats, sym_raw_samples, SIZET2NUM(_stackprof.raw_samples_len));
+    rb_hash_aset(stats, sym_raw_bytes, SIZET2NUM(
+	_stackprof.raw_nodes_capa * sizeof(stack_node_t) +
+	_stackprof.raw_nodes_index_capa * sizeof(unsigned int) +
+	_stackprof.raw_samples_capa * sizeof(raw_sample_t)));
+    rb_hash_aset(stats, sym_heap_live, SIZET2NUM(HASH_COUNT(_stackprof.frames_heap_live)));
+    rb_hash_aset(stats, sym_heap_stacks, SIZET2NUM(HASH_COUNT(_stackprof.heap_stacks)));
+
+    return stats;
+}
+
+static inline size_t
+stack_trie_hash(unsigned int parent, VALUE frame)
+{
+    return stackprof_hash_mix(((uint64_t)frame >> 3) ^ ((uint64_t)parent * 0x9e3779b97f4a7c15ULL));
+}
+
+static void
+stack_trie_rehash(size_t capa)
+{
+    size_t n, i, mask = capa - 1;
+
+    free(_stackprof.raw_nodes_index);
+    _stackprof.raw_nodes_index = calloc(capa, sizeof(unsigned int));
+    _stackprof.raw_nodes_index_capa = capa;
+
+    for (n = 1; n < _stackprof.raw_nodes_len; n++) {
+	i = stack_trie_hash(_stackprof.raw_nodes[n].parent, _stackprof.raw_nodes[n].frame) & mask;
+	while (_stackprof.raw_nodes_index[i])
+	    i = (i + 1) & mask;
+	_stackprof.raw_nodes_index[i] = (unsigned int)n;
+    }
+}
+
+/* find or add the node for +frame+ called from +parent+ */
+static unsigned int
+stack_trie_child(unsigned int parent, VALUE frame)
+{
+    size_t i, mask;
+    unsigned int n;
+    stack_node_t *node;
+
+    if (!_stackprof.raw_nodes) {
+	_stackprof.raw_nodes_capa = 1024;
+	_stackprof.raw_nodes = malloc(sizeof(stack_node_t) * _stackprof.raw_nodes_capa);
+	_stackprof.raw_nodes[0].frame = Qnil;
+	_stackprof.raw_nodes[0].parent = 0;
+	_stackprof.raw_nodes_len = 1;
+	stack_trie_rehash(2048);
+    }
+
+    mask = _stackprof.raw_nodes_index_capa - 1;
+    i = stack_trie_hash(parent, frame) & mask;
+    while ((n = _stackprof.raw_nodes_index[i])) {
+	node = &_stackprof.raw_nodes[n];
+	if (node->frame == frame && node->parent == parent)
+	    return n;
+	i = (i + 1) & mask;
+    }
+
+    if (_stackprof.raw_nodes_capa <= _stackprof.raw_nodes_len) {
+	_stackprof.raw_nodes_capa *= 2;
+	_stackprof.raw_nodes = realloc(_stackprof.raw_nodes, sizeof(stack_node_t) * _stackprof.raw_nodes_capa);
+    }
+    n = (unsigned int)_stackprof.raw_nodes_len++;
+    _stackprof.raw_nodes[n].frame = frame;
+    _stackprof.raw_nodes[n].parent = parent;
+    _stackprof.raw_nodes_index[i] = n;
+
+    /* keep the index at most half full */
+    if (_stackprof.raw_nodes_len * 2 > _stackprof.raw_nodes_index_capa)
+	stack_trie_rehash(_stackprof.raw_nodes_index_capa * 2);
+
+    return n;
+}
+
+static unsigned int
+stackprof_thread_index(VALUE thread, VALUE fiber, unsigned int tid)
+{
+    static size_t last;
+    sample_thread_t *entry;
+    size_t n;
+
+    /* consecutive samples are usually on the same thread */
+    if (last < _stackprof.threads_len) {
+	entry = &_stackprof.threads[last];
+	if (entry->thread == thread && entry->fiber == fiber && entry->tid == tid)
+	    return (unsigned int)last + 1;
+    }
+
+    for (n = 0; n < _stackprof.threads_len; n++) {
+	entry = &_stackprof.threads[n];
+	if (entry->thread == thread && entry->fiber == fiber && entry->tid == tid)
+	    return (unsigned int)(last = n) + 1;
+    }
+
+    if (_stackprof.threads_capa <= _stackprof.threads_len) {
+	_stackprof.threads_capa = _stackprof.threads_capa ? _stackprof.threads_capa * 2 : 16;
+	_stackprof.threads = realloc(_stackprof.threads, sizeof(sample_thread_t) * _stackprof.threads_capa);
+    }
+    entry = &_stackprof.threads[_stackprof.threads_len];
+    entry->thread = thread;
+    entry->fiber = fiber;
+    entry->tid = tid;
+    entry->samples = 0;
+    last = _stackprof.threads_len++;
+    return (unsigned int)last + 1;
+}
+
+void
+stackprof_record_sample()
+{
+    int num;
+    size_t weight = _stackprof.interval_scale;
+
+    _stackprof.overall_samples += weight;
+    if (_stackprof.timestamps)
+	_stackprof.sample_timestamp = stackprof_timestamp();
+    num = rb_profile_frames(0, sizeof(_stackprof.frames_buffer) / sizeof(VALUE), _stackprof.frames_buffer, _stackprof.lines_buffer);
+
+    if (_stackprof.mode == sym_heap)
+        return;
+
+    if (_stackprof.track_threads) {
+	/* rb_fiber_current may allocate the root fiber, which a NEWOBJ hook can't */
+	VALUE fiber = _stackprof.mode == sym_object ? Qnil : rb_fiber_current();
+	_stackprof.sample_thread = stackprof_thread_index(rb_thread_current(), fiber, 0);
+    }
+    _stackprof.sample_tag = thread_tag;
+    stackprof_process_sample(_stackprof.frames_buffer, _stackprof.lines_buffer, num, weight);
+    _stackprof.sample_thread = 0;
+    _stackprof.sample_tag = 0;
+    _stackprof.last_num = num;
+    _stackprof.last_tag = thread_tag;
+}
+
+/*
+ * Records the samples the signal handler counted during GC, as the GC
+ * frames (and the phase it was in) on top of the last stack sampled
+ * before it. GC is triggered by the code that was running, so that is
+ * where its time is charged.
+ */
+static void
+stackprof_record_gc_samples(void)
+{
+    /* total first: the signal handler bumps the phase before the total */
+    size_t total = __atomic_exchange_n(&_stackprof.unrecorded_gc_samples, 0, __ATOMIC_ACQ_REL);
+    size_t marking = __atomic_exchange_n(&_stackprof.unrecorded_gc_marking, 0, __ATOMIC_ACQ_REL);
+    size_t sweeping = __atomic_exchange_n(&_stackprof.unrecorded_gc_sweeping, 0, __ATOMIC_ACQ_REL);
+    size_t other = total > marking + sweeping ? total - marking - sweeping : 0;
+    int num = _stackprof.last_num;
+
+    memcpy(_stackprof.gc_frames_buffer + 2, _stackprof.frames_buffer, num * sizeof(VALUE));
+    memcpy(_stackprof.gc_lines_buffer + 2, _stackprof.lines_buffer, num * sizeof(int));
+    _stackprof.gc_frames_buffer[1] = FAKE_FRAME_GC;
+    _stackprof.gc_lines_buffer[0] = _stackprof.gc_lines_buffer[1] = 0;
+    _stackprof.sample_state = STATE_GC;
+    _stackprof.sample_tag = _stackprof.last_tag;
+    if (_stackprof.timestamps)
+	_stackprof.sample_timestamp = stackprof_timestamp();
+
+    if (marking) {
+	_stackprof.gc_frames_buffer[0] = FAKE_FRAME_MARK;
+	stackprof_process_sample(_stackprof.gc_frames_buffer, _stackprof.gc_lines_buffer, num + 2, marking);
+    }
+    if (sweeping) {
+	_stackprof.gc_frames_buffer[0] = FAKE_FRAME_SWEEP;
+	stackprof_process_sample(_stackprof.gc_frames_buffer, _stackprof.gc_lines_buffer, num + 2, sweeping);
+    }
+    if (other)
+	stackprof_process_sample(_stackprof.gc_frames_buffer + 1, _stackprof.gc_lines_buffer + 1, num + 1, other);
+
+    _stackprof.sample_state = STATE_RUNNING;
+    _stackprof.sample_tag = 0;
+}
+
+/* charges the samples taken since +depth+ was pushed to it, and pops it */
+static void
+stack_cache_pop(int depth)
+{
+    cached_frame_t *entry = &_stackprof.stack[depth];
+    frame_data_t *frame_data = entry->data;
+    size_t weight = _stackprof.stack_weight - entry->weight;
+    int state;
+
+    frame_data->total_samples += weight;
+
+    if (_stackprof.track_states) {
+	if (!frame_data->states)
+	    frame_data->states = calloc(2 * STATE_COUNT, sizeof(size_t));
+	for (state = 0; state < STATE_COUNT; state++)
+	    frame_data->states[2*state] += _stackprof.stack_states[state] - entry->states[state];
+    }
+
+    if (_stackprof.aggregate) {
+	if (depth > 0)
+	    frame_data_edge_increment(_stackprof.stack[depth-1].data, entry->frame, weight);
+	if (entry->line > 0)
+	    frame_data_line_increment(frame_data, entry->line, weight, 0);
+    }
+}
+
+/* pops the whole cached stack, so the frame table is up to date */
+static void
+stackprof_flush_stack(void)
+{
+    while (_stackprof.stack_len > 0)
+	stack_cache_pop(--_stackprof.stack_len);
+}
+
+void
+stackprof_process_sample(VALUE *frames_buffer, int *lines_buffer, int num, size_t weight)
+{
+    int depth = 0, i;
+    size_t frames_len;
+    cached_frame_t *entry;
+
+    if (_stackprof.sample_thread)
+	_stackprof.threads[_stackprof.sample_thread - 1].samples += weight;
+    if (_stackprof.track_states)
+	_stackprof.state_samples[_stackprof.sample_state] += weight;
+    if (_stackprof.sample_tag) {
+	if (_stackprof.tag_samples_len < _stackprof.sample_tag) {
+	    size_t len = RARRAY_LEN(tag_names);
+	    _stackprof.tag_samples = realloc(_stackprof.tag_samples, len * sizeof(size_t));
+	    memset(_stackprof.tag_samples + _stackprof.tag_samples_len, 0, (len - _stackprof.tag_samples_len) * sizeof(size_t));
+	    _stackprof.tag_samples_len = len;
+	}
+	_stackprof.tag_samples[_stackprof.sample_tag - 1] += weight;
+    }
+
+    /* frames_buffer is leaf first, the cached stack root first */
+    while (depth < _stackprof.stack_len && depth < num &&
+	   _stackprof.stack[depth].frame == frames_buffer[num-1-depth] &&
+	   _stackprof.stack[depth].line == lines_buffer[num-1-depth])
+	depth++;
+    while (_stackprof.stack_len > depth)
+	stack_cache_pop(--_stackprof.stack_len);
+
+    for (; depth < num; depth++) {
+	entry = &_stackprof.stack[depth];
+	entry->frame = frames_buffer[num-1-depth];
+	entry->line = lines_buffer[num-1-depth];
+	entry->node = _stackprof.raw ? stack_trie_child(depth ? entry[-1].node : 0, entry->frame) : 0;
+	frames_len = _stackprof.frames->len;
+	entry->data = frame_table_lookup(_stackprof.frames, entry->frame);
+	if (_stackprof.symbolize && _stackprof.frames->len != frames_len)
+	    stackprof_symbolize_later(entry->frame);
+	entry->weight = _stackprof.stack_weight;
+	memcpy(entry->states, _stackprof.stack_states, sizeof(entry->states));
+	_stackprof.stack_len = depth + 1;
+
+	/* the table grew, and moved the data the other entries point to */
+	if (_stackprof.stack_capa != _stackprof.frames->capa) {
+	    _stackprof.stack_capa = _stackprof.frames->capa;
+	    for (i = 0; i < depth; i++)
+		_stackprof.stack[i].data = frame_table_lookup(_stackprof.frames, _stackprof.stack[i].frame);
+	}
+    }
+
+    _stackprof.stack_weight += weight;
+    if (_stackprof.track_states)
+	_stackprof.stack_states[_stackprof.sample_state] += weight;
+
+    /* only the leaf's self counts can't wait until it's popped */
+    if (num > 0) {
+	entry = &_stackprof.stack[num-1];
+	entry->data->caller_samples += weight;
+	if (_stackprof.track_states) {
+	    if (!entry->data->states)
+		entry->data->states = calloc(2 * STATE_COUNT, sizeof(size_t));
+	    entry->data->states[2*_stackprof.sample_state+1] += weight;
+	}
+	if (_stackprof.aggregate && entry->line > 0)
+	    frame_data_line_increment(entry->data, entry->line, 0, weight);
+    }
+
+    if (_stackprof.raw) {
+	unsigned int node = num > 0 ? _stackprof.stack[num-1].node : 0;
+	raw_sample_t *last;
+
+	/* timestamped samples are kept apart, so each one has its own time */
+	last = _stackprof.raw_samples_len && !_stackprof.timestamps ? &_stackprof.raw_samples[_stackprof.raw_samples_len-1] : NULL;
+	if (last && last->node == node && last->thread == _stackprof.sample_thread && last->tag == _stackprof.sample_tag &&
+	    last->weight <= UINT_MAX - weight) {
+	    last->weight += (unsigned int)weight;
+	} else {
+	    if (_stackprof.raw_samples_capa <= _stackprof.raw_samples_len) {
+		_stackprof.raw_samples_capa = _stackprof.raw_samples_capa ? _stackprof.raw_samples_capa * 2 : 1024;
+		_stackprof.raw_samples = realloc(_stackprof.raw_samples, sizeof(raw_sample_t) * _stackprof.raw_samples_capa);
+	    }
+	    last = &_stackprof.raw_samples[_stackprof.raw_samples_len++];
+	    last->node = node;
+	    last->weight = (unsigned int)weight;
+	    last->thread = _stackprof.sample_thread;
+	    last->tag = _stackprof.sample_tag;
+	    last->delta = 0;
+	    if (_stackprof.timestamps) {
+		/* deltas are rounded down, so carry the remainder into the next one */
+		uint64_t now = _stackprof.sample_timestamp;
+		if (now > _stackprof.last_timestamp) {
+		    uint64_t delta = (now - _stackprof.last_timestamp) / 1000;
+		    last->delta = delta > UINT_MAX ? UINT_MAX : (unsigned int)delta;
+		    _stackprof.last_timestamp += (uint64_t)last->delta * 1000;
+		}
+	    }
+	}
+    }
+}
+
+/*
+ * Picks the smallest multiple of the requested interval at which the
+ * average cost of a sample stays within the overhead budget. It widens as
+ * soon as the budget is exceeded, but only narrows again once there's
+ * clearly room, so it doesn't flap between neighbouring multiples.
+ */
+static void
+stackprof_adapt_interval(void)
+{
+    long base = NUM2LONG(_stackprof.interval);
+    double cost = (double)_stackprof.sample_cost / _stackprof.sample_cost_count / 1000;
+    double wanted = cost / _stackprof.overhead / base;
+    size_t scale = wanted > 1 ? (size_t)wanted + 1 : 1;
+    size_t max_scale = base < MAX_INTERVAL ? MAX_INTERVAL / base : 1;
+
+    _stackprof.sample_cost = 0;
+    _stackprof.sample_cost_count = 0;
+
+    if (scale > max_scale)
+	scale = max_scale;
+    if (scale == _stackprof.interval_scale)
+	return;
+    if (scale < _stackprof.interval_scale && scale * 4 > _stackprof.interval_scale * 3)
+	return;
+
+    _stackprof.interval_scale = scale;
+    stackprof_push_interval(base * scale);
+#ifdef STACKPROF_THREAD_TIMERS
+    if (_stackprof.per_thread)
+	thread_timers_set_interval(base * scale);
+    else
+#endif
+    stackprof_set_timer(_stackprof.mode, base * scale);
+}
+
+static inline void
+stackprof_add_sample_cost(uint64_t cost, size_t count)
+{
+    _stackprof.sample_cost += cost;
+    _stackprof.sample_cost_count += count;
+    if (_stackprof.running && _stackprof.sample_cost_count >= OVERHEAD_WINDOW)
+	stackprof_adapt_interval();
+}
+
+static int in_signal_handler = 0;
+
+static inline void
+stackprof_add_job_time(uint64_t start)
+{
+    _stackprof.job_time += stackprof_timestamp() - start;
+    _stackprof.jobs++;
+}
+
+static void
+stackprof_job_handler(void *data)
+{
+    uint64_t start, cost;
+
+    if (in_signal_handler) {
+	_stackprof.reentrant_drops++;
+	return;
+    }
+    if (!_stackprof.running) return;
+
+    in_signal_handler++;
+    start = stackprof_timestamp();
+    stackprof_record_sample();
+    cost = stackprof_timestamp() - start;
+    _stackprof.job_time += cost;
+    _stackprof.jobs++;
+    if (_stackprof.overhead)
+	stackprof_add_sample_cost(cost, 1);
+    in_signal_handler--;
+}
+
+static void
+stackprof_drain_ring(void)
+{
+    sample_ring_t *ring = _stackprof.ring;
+    sample_record_t *record = NULL;
+    uint64_t start = _stackprof.overhead ? stackprof_timestamp() : 0;
+    size_t count = 0;
+
+    /* clear first: a sample pushed while draining schedules another job */
+    __atomic_store_n(&ring->job_pending, 0, __ATOMIC_RELEASE);
+
+    while (ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+	record = &ring->records[ring->tail & (RING_SIZE-1)];
+	_stackprof.overall_samples += record->weight;
+	_stackprof.sample_thread = (record->tid || RTEST(record->thread)) ?
+	    stackprof_thread_index(record->thread, Qnil, record->tid) : 0;
+	_stackprof.sample_state = record->state;
+	_stackprof.sample_tag = record->tag;
+	_stackprof.sample_timestamp = record->timestamp;
+	stackprof_process_sample(record->frames, record->lines, record->num, record->weight);
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+	count++;
+    }
+    _stackprof.sample_thread = 0;
+    _stackprof.sample_state = STATE_RUNNING;
+    _stackprof.sample_tag = 0;
+
+    /* the newest record is what GC samples get charged to */
+    if (record) {
+	memcpy(_stackprof.frames_buffer, record->frames, record->num * sizeof(VALUE));
+	memcpy(_stackprof.lines_buffer, record->lines, record->num * sizeof(int));
+	_stackprof.last_num = record->num;
+	_stackprof.last_tag = record->tag;
+    }
+
+    if (_stackprof.overhead && count)
+	stackprof_add_sample_cost(stackprof_timestamp() - start, count);
+}
+
+static void
+stackprof_job_record_gc(void *data)
+{
+    uint64_t start;
+
+    if (!_stackprof.running) return;
+
+    start = stackprof_timestamp();
+    stackprof_record_gc_samples();
+    stackprof_add_job_time(start);
+}
+
+static void
+stackprof_job_drain_ring(void *data)
+{
+    uint64_t start;
+
+    if (in_signal_handler) {
+	_stackprof.reentrant_drops++;
+	return;
+    }
+    if (!_stackprof.running || !_stackprof.buffered) return;
+
+    in_signal_handler++;
+    start = stackprof_timestamp();
+    stackprof_drain_ring();
+    stackprof_add_job_time(start);
+    in_signal_handler--;
+}
+
+/* the signal handler counts jobs the VM had no room for */
+static inline int
+stackprof_register_job(stackprof_job_t job)
+{
+    if (stackprof_trigger_job(job))
+	return 1;
+    __atomic_fetch_add(&_stackprof.job_register_failures, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void
+stackprof_buffer_sample(void)
+{
+    sample_ring_t *ring;
+    sample_record_t *record;
+    size_t head, tail;
+
+    /* rb_profile_frames needs a ruby thread; the lock keeps a single producer */
+    if (!ruby_native_thread_p()) return;
+    if (pthread_mutex_trylock(&ring_lock)) return;
+    /* stackprof_stop got here first */
+    if (!(ring = _stackprof.ring)) {
+	pthread_mutex_unlock(&ring_lock);
+	return;
+    }
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    /* when the ring is full the sample is dropped and shows up as missed */
+    if (head - tail < RING_SIZE) {
+	record = &ring->records[head & (RING_SIZE-1)];
+	record->timestamp = stackprof_timestamp();
+	record->weight = (unsigned int)_stackprof.interval_scale;
+#ifdef STACKPROF_THREAD_TIMERS
+	record->tid = _stackprof.per_thread ? (unsigned int)thread_tid : 0;
+#else
+	record->tid = 0;
+#endif
+	/* only reads the thread's own ec; fibers can't be looked up from here */
+	record->thread = _stackprof.track_threads ? rb_thread_current() : Qnil;
+	record->tag = thread_tag;
+#ifdef STACKPROF_THREAD_EVENTS
+	record->state = thread_state;
+#else
+	record->state = STATE_RUNNING;
+#endif
+	record->num = rb_profile_frames(0, BUF_SIZE, record->frames, record->lines);
+	/* the capture is part of the cost too; the drain job adds it up */
+	if (_stackprof.overhead)
+	    __atomic_fetch_add(&_stackprof.sample_cost, stackprof_timestamp() - record->timestamp, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	if (!__atomic_load_n(&ring->job_pending, __ATOMIC_ACQUIRE) &&
+	    stackprof_register_job(JOB_DRAIN_RING))
+	    __atomic_store_n(&ring->job_pending, 1, __ATOMIC_RELEASE);
+    } else {
+	__atomic_fetch_add(&_stackprof.ring_overflows, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void
+stackprof_signal_handler(int sig, siginfo_t *sinfo, void *ucontext)
+{
+    /* each signal stands for interval_scale of the requested intervals */
+    size_t weight = __atomic_load_n(&_stackprof.interval_scale, __ATOMIC_RELAXED);
+
+    /* StackProf.snapshot may be swapping the counters out on another thread */
+    __atomic_fetch_add(&_stackprof.overall_signals, weight, __ATOMIC_RELAXED);
+    if (rb_during_gc()) {
+	__atomic_fetch_add(&_stackprof.during_gc, weight, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&_stackprof.overall_samples, weight, __ATOMIC_RELAXED);
+	if (!_stackprof.ignore_gc) {
+	    int phase = __atomic_load_n(&gc_phase, __ATOMIC_RELAXED);
+
+	    if (phase == GC_PHASE_MARKING)
+		__atomic_fetch_add(&_stackprof.unrecorded_gc_marking, weight, __ATOMIC_RELAXED);
+	    else if (phase == GC_PHASE_SWEEPING)
+		__atomic_fetch_add(&_stackprof.unrecorded_gc_sweeping, weight, __ATOMIC_RELAXED);
+	    __atomic_fetch_add(&_stackprof.unrecorded_gc_samples, weight, __ATOMIC_RELEASE);
+	    stackprof_register_job(JOB_RECORD_GC);
+	}
+    } else if (_stackprof.buffered)
+	stackprof_buffer_sample();
+    else
+	stackprof_register_job(JOB_SAMPLE);
+}
+
+static void
+stackprof_newobj_handler(VALUE tpval, void *data)
+{
+    size_t samples;
+
+    if (_stackprof.symbolizing || --_stackprof.alloc_countdown > 0)
+	return;
+    stackprof_next_allocation_sample();
+
+    samples = _stackprof.overall_samples;
+    stackprof_job_handler(0);
+    if (_stackprof.overall_samples != samples)
+	stackprof_defer_object_size(rb_tracearg_object(rb_tracearg_from_tracepoint(tpval)));
+}
+
+
+static void
+stackprof_newobj_handler_heap(VALUE tpval, void *data)
+{
+    allocation_info_t *info = NULL;
+    rb_trace_arg_t *tparg;
+    VALUE obj;
+    int num;
+
+    if (--_stackprof.alloc_countdown > 0)
+	return;
+    stackprof_next_allocation_sample();
+
+    tparg = rb_tracearg_from_tracepoint(tpval);
+    obj = rb_tracearg_object(tparg);
+    _stackprof.overall_samples++;
+
+    HASH_FIND(hh, _stackprof.frames_heap_live, &obj, sizeof(VALUE), info);
+    if (info) {
+        heap_stack_unref(info->stack);
+    } else {
+        info = heap_arena_alloc(&_stackprof.heap_arena, sizeof(allocation_info_t));
+        info->obj = obj;
+        HASH_ADD(hh, _stackprof.frames_heap_live, obj, sizeof(VALUE), info);
+    }
+
+    num = rb_profile_frames(0, sizeof(_stackprof.frames_buffer) / sizeof(VALUE), _stackprof.frames_buffer, _stackprof.lines_buffer);
+
+    info->stack = heap_stack_ref(_stackprof.frames_buffer, _stackprof.lines_buffer, num);
+    info->living = 1;
+    info->flags = RBASIC(obj)->flags;
+    info->klass = RBASIC_CLASS(obj);
+
+    // We will not compute memory used here, we will do it later. It appears
+    // this trace callback is called before the object in question is
+    // populated.
+    info->memsize = 0;
+}
+
+
+static void
+stackprof_freeobj_handler_heap(VALUE tpval, void *data)
+{
+    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
+    VALUE obj = rb_tracearg_object(tparg);
+    allocation_info_t *info = NULL;
+
+    HASH_FIND(hh, _stackprof.frames_heap_live, &obj, sizeof(VALUE), info);
+    if (info) {
+        // If we are tracking all heap allocations, don't free the
+        // allocation info.
+        if (_stackprof.heap_all)
+        {
+            info->memsize = get_object_size(obj);
+            info->living = 0;
+        }
+        else
+        {
+            HASH_DEL(_stackprof.frames_heap_live, info);
+            heap_stack_unref(info->stack);
+            heap_arena_free(&_stackprof.heap_arena, info, sizeof(allocation_info_t));
+
+            // We need to treat this as if we didn't really sample this
+            _stackprof.overall_signals--;
+            _stackprof.overall_samples--;
+        }
+    }
+}
+
+static VALUE
+stackprof_sample(VALUE self)
+{
+    if (!_stackprof.running)
+	return Qfalse;
+
+    _stackprof.overall_signals++;
+    stackprof_job_handler(0);
+    return Qtrue;
+}
+
+static VALUE
+stackprof_with_tag_yield(VALUE tag)
+{
+    return rb_yield(tag);
+}
+
+static VALUE
+stackprof_with_tag_restore(VALUE previous)
+{
+    thread_tag = NUM2UINT(previous);
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *    StackProf.with_tag(tag) { |tag| ... } -> obj
+ *
+ *  Tags the samples taken on this thread while the block runs, so a
+ *  long-running profiler can be sliced by request or endpoint afterwards.
+ *  Blocks nest, the innermost tag winning, and a nil tag untags. Tags are
+ *  interned for the life of the process, so use endpoints, not request ids.
+ *
+ *  The tag belongs to the native thread, not the fiber: a fiber resumed
+ *  inside the block is sampled under the block's tag, and one that yields
+ *  out of it leaves the tag on for whatever runs next on the thread.
+ */
+static VALUE
+stackprof_with_tag(VALUE self, VALUE tag)
+{
+    unsigned int previous = thread_tag;
+    VALUE index;
+
+    rb_need_block();
+    if (NIL_P(tag)) {
+	thread_tag = 0;
+    } else {
+	if (NIL_P(index = rb_hash_lookup(tag_indexes, tag))) {
+	    if (RB_TYPE_P(tag, T_STRING))
+		tag = rb_str_new_frozen(tag);
+	    rb_ary_push(tag_names, tag);
+	    index = LONG2FIX(RARRAY_LEN(tag_names));
+	    rb_hash_aset(tag_indexes, tag, index);
+	}
+	thread_tag = FIX2UINT(index);
+    }
+    return rb_ensure(stackprof_with_tag_yield, tag, stackprof_with_tag_restore, UINT2NUM(previous));
+}
+
+static void
+stackprof_gc_mark(void *data)
+{
+    heap_stack_t *stack, *tmp;
+    int i;
+
+    if (RTEST(_stackprof.out))
+	rb_gc_mark(_stackprof.out);
+
+    if (_stackprof.frames) {
+	size_t n;
+	for (n = 0; n < _stackprof.frames->capa; n++)
+	    if (_stackprof.frames->entries[n].frame)
+		rb_gc_mark(_stackprof.frames->entries[n].frame);
+    }
+
+    if (detached_profile && detached_profile->frames) {
+	size_t n;
+	for (n = 0; n < detached_profile->frames->capa; n++)
+	    if (detached_profile->frames->entries[n].frame)
+		rb_gc_mark(detached_profile->frames->entries[n].frame);
+    }
+
+    {
+	size_t n;
+	for (n = 0; n < _stackprof.threads_len; n++) {
+	    rb_gc_mark(_stackprof.threads[n].thread);
+	    rb_gc_mark(_stackprof.threads[n].fiber);
+	}
+	for (n = 0; detached_profile && n < detached_profile->threads_len; n++) {
+	    rb_gc_mark(detached_profile->threads[n].thread);
+	    rb_gc_mark(detached_profile->threads[n].fiber);
+	}
+    }
+
+    /* resolved frames stay cached, so their addresses can't be reused by others */
+    {
+	size_t n;
+	for (n = 0; n < symbols.capa; n++)
+	    if (symbols.entries[n].frame)
+		rb_gc_mark(symbols.entries[n].frame);
+	for (n = 0; n < symbols.pending_len; n++)
+	    rb_gc_mark(symbols.pending[n]);
+    }
+
+    /* keeps them from being freed (and their slot reused) before they're sized */
+    for (i = 0; i < _stackprof.pending_sizes_len; i++)
+	rb_gc_mark(_stackprof.pending_sizes[i].obj);
+
+    if (_stackprof.ring) {
+	sample_ring_t *ring = _stackprof.ring;
+	size_t n, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for (n = ring->tail; n != head; n++) {
+	    sample_record_t *record = &ring->records[n & (RING_SIZE-1)];
+	    rb_gc_mark(record->thread);
+	    for (i = 0; i < record->num; i++)
+		rb_gc_mark(record->frames[i]);
+	}
+    }
+
+    HASH_ITER(hh, _stackprof.heap_stacks, stack, tmp) {
+        for (i = 0; i < stack->num; i++) {
+            rb_gc_mark(stack->frames[i]);
+        }
+    }
+}
+
+static void
+stackprof_atfork_prepare(void)
+{
+    struct itimerval timer;
+    /* per_thread timers keep running; only their owning thread is signalled */
+    if (_stackprof.running && !_stackprof.per_thread) {
+	if (_stackprof.mode == sym_wall || _stackprof.mode == sym_cpu) {
+	    memset(&timer, 0, sizeof(timer));
+	    setitimer(_stackprof.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+	}
+    }
+}
+
+static void
+stackprof_atfork_parent(void)
+{
+    if (_stackprof.running && !_stackprof.per_thread) {
+	if (_stackprof.mode == sym_wall || _stackprof.mode == sym_cpu)
+	    stackprof_set_timer(_stackprof.mode, NUM2LONG(_stackprof.interval) * _stackprof.interval_scale);
+    }
+}
+
+/*
+ * With follow_fork the child carries on profiling into a profile of its
+ * own. What it inherited is the parent's and is dropped, not freed: those
+ * pages are still shared with the parent, and freeing them would copy
+ * them. Timers aren't inherited across fork, so they're armed again;
+ * signal handlers, tracepoints and thread hooks are.
+ */
+static void
+stackprof_follow_fork(void)
+{
+    profile_t inherited;
+
+    _stackprof.stack_len = 0;
+    stackprof_detach_profile(&inherited);
+    _stackprof.frames = frame_table_new(1024);
+    _stackprof.forked = 1;
+    _stackprof.pid = getpid();
+    _stackprof.job_time = 0;
+    _stackprof.jobs = 0;
+    _stackprof.job_register_failures = 0;
+    _stackprof.reentrant_drops = 0;
+    _stackprof.ring_overflows = 0;
+    _stackprof.unrecorded_gc_samples = 0;
+    _stackprof.unrecorded_gc_marking = 0;
+    _stackprof.unrecorded_gc_sweeping = 0;
+    _stackprof.last_num = 0;
+    stackprof_reset_clock();
+
+    if (_stackprof.mode == sym_object || _stackprof.mode == sym_heap) {
+	_stackprof.frames_heap_live = NULL;
+	_stackprof.heap_stacks = NULL;
+	MEMZERO(&_stackprof.heap_arena, heap_arena_t, 1);
+	_stackprof.pending_sizes_len = 0;
+    } else if (_stackprof.mode == sym_wall || _stackprof.mode == sym_cpu) {
+	long interval = NUM2LONG(_stackprof.interval) * _stackprof.interval_scale;
+
+	if (_stackprof.ring) {
+	    _stackprof.ring->head = _stackprof.ring->tail = 0;
+	    _stackprof.ring->job_pending = 0;
+	}
+	if (_stackprof.overhead)
+	    stackprof_push_interval(interval);
+#ifdef STACKPROF_THREAD_TIMERS
+	if (_stackprof.per_thread) {
+	    thread_timers_stop(1);
+	    thread_tid = 0;
+	    thread_timers_start(interval);
+	} else
+#endif
+	stackprof_set_timer(_stackprof.mode, interval);
+    }
+}
+
+static void
+stackprof_atfork_child(void)
+{
+    /*
+     * other threads may have held these when the parent forked: the ring
+     * lock from a signal handler, the timer lock from a thread hook
+     */
+    pthread_mutex_init(&ring_lock, NULL);
+#ifdef STACKPROF_THREAD_TIMERS
+    pthread_mutex_init(&thread_timers.lock, NULL);
+#endif
+
+    if (_stackprof.running && _stackprof.follow_fork) {
+	stackprof_follow_fork();
+	return;
+    }
+
+    if (_stackprof.running) {
+        if (_stackprof.mode == sym_heap) {
+            heap_release();
+        }
+#ifdef STACKPROF_THREAD_TIMERS
+	if (_stackprof.per_thread)
+	    thread_timers_stop(1);
+#endif
+    }
+
+    stackprof_stop(rb_mStackProf);
+}
+
+/*
+ * StackProf::Merger folds any number of profiles into one. Frames are
+ * matched across profiles on the same key they get in results and summed
+ * into a frame table of the merger's own, of the same kind the profiler
+ * samples into (under a dense index, so the raw stack trie can pack it),
+ * and raw stacks are inserted into a merged trie. Every profile is walked
+ * once as it's added, so merging is linear in the total size of the
+ * profiles and only the merged tables are kept around.
+ */
+typedef struct {
+    VALUE mode;
+    VALUE interval;
+    VALUE keys; /* frame key => merged frame index */
+    VALUE infos; /* [name, file, line, key] of merged frame index n at n-1 */
+    VALUE threads;
+    size_t threads_len;
+    VALUE tags; /* merged tag index => { name:, samples: } */
+    VALUE tag_indexes; /* tag => merged tag index */
+    size_t profiles;
+    size_t samples;
+    size_t gc_samples;
+    size_t missed_samples;
+    int states;
+    size_t state_samples[STATE_COUNT];
+    frame_table_t *frames;
+    int raw; /* cleared by the first profile without raw stacks */
+    stack_node_t *nodes;
+    size_t nodes_len;
+    size_t nodes_capa;
+    st_table *children; /* parent node << 32 | frame id => node */
+    raw_sample_t *raw_samples;
+    size_t raw_samples_len;
+    size_t raw_samples_capa;
+} merger_t;
+
+/* a profile being added: its frame ids => merged frame indexes (as Fixnums) */
+typedef struct {
+    merger_t *merger;
+    VALUE ids;
+    VALUE tags; /* its tag indexes => merged tag indexes */
+    frame_data_t *frame_data; /* of the frame whose edges are being added */
+} merger_profile_t;
+
+static void
+merger_release_raw(merger_t *merger)
+{
+    free(merger->nodes);
+    free(merger->raw_samples);
+    if (merger->children)
+	st_free_table(merger->children);
+    merger->nodes = NULL;
+    merger->raw_samples = NULL;
+    merger->children = NULL;
+    merger->nodes_len = merger->nodes_capa = 0;
+    merger->raw_samples_len = merger->raw_samples_capa = 0;
+}
+
+static void
+merger_mark(void *ptr)
+{
+    merger_t *merger = ptr;
+
+    rb_gc_mark(merger->mode);
+    rb_gc_mark(merger->interval);
+    rb_gc_mark(merger->keys);
+    rb_gc_mark(merger->infos);
+    rb_gc_mark(merger->threads);
+    rb_gc_mark(merger->tags);
+    rb_gc_mark(merger->tag_indexes);
+}
+
+static void
+merger_free(void *ptr)
+{
+    merger_t *merger = ptr;
+
+    frame_table_free(merger->frames);
+    merger_release_raw(merger);
+    xfree(merger);
+}
+
+static size_t
+merger_memsize(const void *ptr)
+{
+    const merger_t *merger = ptr;
+
+    return sizeof(merger_t) + merger->frames->capa * sizeof(frame_entry_t) +
+	merger->nodes_capa * sizeof(stack_node_t) + merger->raw_samples_capa * sizeof(raw_sample_t);
+}
+
+static const rb_data_type_t merger_type = {
+    "StackProf::Merger",
+    { merger_mark, merger_free, merger_memsize, NULL },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+merger_alloc(VALUE klass)
+{
+    merger_t *merger;
+    VALUE self = TypedData_Make_Struct(klass, merger_t, &merger_type, merger);
+
+    merger->mode = merger->interval = Qnil;
+    merger->keys = rb_hash_new();
+    merger->infos = rb_ary_new();
+    merger->threads = rb_hash_new();
+    merger->tags = rb_hash_new();
+    merger->tag_indexes = rb_hash_new();
+    merger->frames = frame_table_new(1024);
+    merger->raw = 1;
+    return self;
+}
+
+static size_t
+merger_count(VALUE hash, VALUE key)
+{
+    VALUE count = rb_hash_lookup(hash, key);
+    return NIL_P(count) ? 0 : NUM2SIZET(count);
+}
 
-	rb_hash_aset(results, sym_raw, raw_samples);
-    }
+/*
+ * Older profiles are translated as they're added (frames are matched on
+ * their name, file and line whatever their ids, and the flat :raw layout
+ * and single line counts are read too), so any version up to this one's
+ * merges; newer ones might mean something else by the same keys.
+ */
+static void
+merger_version(VALUE data)
+{
+    VALUE version = rb_hash_lookup(data, sym_version);
 
-    if (argc == 1)
-	_stackprof.out = argv[0];
+    if (!RB_FLOAT_TYPE_P(version) && !RB_INTEGER_TYPE_P(version))
+	rb_raise(rb_eArgError, "profile has no version");
+    if (NUM2DBL(version) > RESULTS_VERSION)
+	rb_raise(rb_eArgError, "cannot merge v%"PRIsVALUE" profiles, only up to v%.1f", version, RESULTS_VERSION);
+}
 
-    if (RTEST(_stackprof.out)) {
-	VALUE file;
-	if (RB_TYPE_P(_stackprof.out, T_STRING)) {
-	    file = rb_file_open_str(_stackprof.out, "w");
-	} else {
-	    file = rb_io_check_io(_stackprof.out);
-	}
-	rb_marshal_dump(results, file);
-	rb_io_flush(file);
-	_stackprof.out = Qnil;
-	return file;
-    } else {
-	return results;
+static VALUE
+merger_frame_id(merger_t *merger, VALUE info)
+{
+    VALUE name = rb_hash_lookup(info, sym_name);
+    VALUE file = rb_hash_lookup(info, sym_file);
+    VALUE line = rb_hash_lookup(info, sym_line);
+    VALUE key = ULL2NUM(stackprof_frame_key(name, file, line)), id;
+
+    if (NIL_P(id = rb_hash_lookup(merger->keys, key))) {
+	rb_ary_push(merger->infos, rb_ary_new3(4, name, file, line, key));
+	id = LONG2FIX(RARRAY_LEN(merger->infos));
+	rb_hash_aset(merger->keys, key, id);
+	frame_table_lookup(merger->frames, id);
     }
+    return id;
 }
 
-static VALUE
-stackprof_run(int argc, VALUE *argv, VALUE self)
+static int
+merger_map_frame_i(VALUE id, VALUE info, VALUE arg)
 {
-    rb_need_block();
-    stackprof_start(argc, argv, self);
-    rb_ensure(rb_yield, Qundef, stackprof_stop, self);
-    return stackprof_results(0, 0, self);
+    merger_profile_t *profile = (merger_profile_t *)arg;
+
+    rb_hash_aset(profile->ids, id, merger_frame_id(profile->merger, info));
+    return ST_CONTINUE;
 }
 
-static VALUE
-stackprof_running_p(VALUE self)
+static int
+merger_add_edge_i(VALUE callee, VALUE weight, VALUE arg)
 {
-    return _stackprof.running ? Qtrue : Qfalse;
+    merger_profile_t *profile = (merger_profile_t *)arg;
+    VALUE id = rb_hash_lookup(profile->ids, callee);
+
+    if (!NIL_P(id))
+	frame_data_edge_increment(profile->frame_data, id, NUM2SIZET(weight));
+    return ST_CONTINUE;
 }
 
-static inline frame_data_t *
-sample_for(VALUE frame)
+static int
+merger_add_line_i(VALUE line, VALUE weight, VALUE arg)
 {
-    st_data_t key = (st_data_t)frame, val = 0;
-    frame_data_t *frame_data;
+    frame_data_t *frame_data = (frame_data_t *)arg;
+    uint64_t total = 0, self;
 
-    if (st_lookup(_stackprof.frames, key, &val)) {
-        frame_data = (frame_data_t *)val;
+    /* profiles before v1.1 only kept a single count per line */
+    if (RB_TYPE_P(weight, T_ARRAY)) {
+	total = NUM2ULL(rb_ary_entry(weight, 0));
+	self = NUM2ULL(rb_ary_entry(weight, 1));
     } else {
-        frame_data = ALLOC_N(frame_data_t, 1);
-        MEMZERO(frame_data, frame_data_t, 1);
-        val = (st_data_t)frame_data;
-        st_insert(_stackprof.frames, key, val);
+	self = NUM2ULL(weight);
     }
-
-    return frame_data;
+    frame_data_line_increment(frame_data, NUM2INT(line), total, self);
+    return ST_CONTINUE;
 }
 
 static int
-numtable_increment_callback(st_data_t *key, st_data_t *value, st_data_t arg, int existing)
+merger_add_frame_i(VALUE id, VALUE info, VALUE arg)
 {
-    size_t *weight = (size_t *)value;
-    size_t increment = (size_t)arg;
+    merger_profile_t *profile = (merger_profile_t *)arg;
+    frame_data_t *frame_data = frame_table_lookup(profile->merger->frames, rb_hash_lookup(profile->ids, id));
+    VALUE edges, lines, states, bytes;
+    int n;
+
+    frame_data->total_samples += merger_count(info, sym_total_samples);
+    frame_data->caller_samples += merger_count(info, sym_samples);
+
+    if (!NIL_P(bytes = rb_hash_lookup(info, sym_total_bytes))) {
+	if (!frame_data->bytes)
+	    frame_data->bytes = calloc(2, sizeof(size_t));
+	frame_data->bytes[0] += NUM2SIZET(bytes);
+	frame_data->bytes[1] += merger_count(info, sym_bytes);
+    }
 
-    if (existing)
-	(*weight) += increment;
-    else
-	*weight = increment;
+    if (RB_TYPE_P(states = rb_hash_lookup(info, sym_states), T_HASH)) {
+	if (!frame_data->states)
+	    frame_data->states = calloc(2 * STATE_COUNT, sizeof(size_t));
+	for (n = 0; n < STATE_COUNT; n++) {
+	    VALUE counts = rb_hash_lookup(states, sym_state_names[n]);
+	    if (RB_TYPE_P(counts, T_ARRAY)) {
+		frame_data->states[2*n] += NUM2SIZET(rb_ary_entry(counts, 0));
+		frame_data->states[2*n+1] += NUM2SIZET(rb_ary_entry(counts, 1));
+	    }
+	}
+    }
+
+    if (RB_TYPE_P(edges = rb_hash_lookup(info, sym_edges), T_HASH)) {
+	profile->frame_data = frame_data;
+	rb_hash_foreach(edges, merger_add_edge_i, (VALUE)profile);
+    }
+
+    if (RB_TYPE_P(lines = rb_hash_lookup(info, sym_lines), T_HASH))
+	rb_hash_foreach(lines, merger_add_line_i, (VALUE)frame_data);
 
     return ST_CONTINUE;
 }
 
-void
-st_numtable_increment(st_table *table, st_data_t key, size_t increment)
+static unsigned int
+merger_node(merger_t *merger, unsigned int parent, VALUE frame)
 {
-    st_update(table, key, numtable_increment_callback, (st_data_t)increment);
+    st_data_t key = ((st_data_t)parent << 32) | (st_data_t)FIX2ULONG(frame), node;
+
+    if (st_lookup(merger->children, key, &node))
+	return (unsigned int)node;
+
+    if (merger->nodes_len == merger->nodes_capa) {
+	merger->nodes_capa *= 2;
+	merger->nodes = realloc(merger->nodes, merger->nodes_capa * sizeof(stack_node_t));
+    }
+    merger->nodes[merger->nodes_len].frame = frame;
+    merger->nodes[merger->nodes_len].parent = parent;
+    st_insert(merger->children, key, (st_data_t)merger->nodes_len);
+    return (unsigned int)merger->nodes_len++;
 }
 
-void
-stackprof_record_sample()
+static void
+merger_push_sample(merger_t *merger, unsigned int node, VALUE weight, unsigned int thread, unsigned int tag)
 {
-    int num;
+    raw_sample_t *sample;
 
-    _stackprof.overall_samples++;
-    num = rb_profile_frames(0, sizeof(_stackprof.frames_buffer) / sizeof(VALUE), _stackprof.frames_buffer, _stackprof.lines_buffer);
-
-    if (_stackprof.mode == sym_heap)
-        return;
+    if (merger->raw_samples_len == merger->raw_samples_capa) {
+	merger->raw_samples_capa = merger->raw_samples_capa ? merger->raw_samples_capa * 2 : 1024;
+	merger->raw_samples = realloc(merger->raw_samples, merger->raw_samples_capa * sizeof(raw_sample_t));
+    }
+    sample = &merger->raw_samples[merger->raw_samples_len++];
+    sample->node = node;
+    sample->weight = NUM2UINT(weight);
+    sample->thread = thread;
+    sample->tag = tag;
+    sample->delta = 0;
+}
 
-    stackprof_process_sample(_stackprof.frames_buffer, _stackprof.lines_buffer, num);
+static inline VALUE
+merger_raw_frame(merger_profile_t *profile, VALUE frame)
+{
+    return rb_hash_lookup(profile->ids, frame);
 }
 
-void
-stackprof_process_sample(VALUE *frames_buffer, int *lines_buffer, int num)
+/* re-inserts the profile's raw stacks into the merged trie; merger_check has vetted them */
+static void
+merger_add_raw(merger_profile_t *profile, VALUE data)
 {
-    int i, n;
-    VALUE prev_frame = Qnil;
+    merger_t *merger = profile->merger;
+    VALUE raw_nodes = rb_hash_lookup(data, sym_raw_nodes);
+    VALUE raw_samples = rb_hash_lookup(data, sym_raw_samples);
+    VALUE sample_threads = rb_hash_lookup(data, sym_raw_sample_threads);
+    VALUE sample_tags = rb_hash_lookup(data, sym_raw_sample_tags);
+    VALUE raw = rb_hash_lookup(data, sym_raw);
+    unsigned int thread_offset = (unsigned int)merger->threads_len;
+    long n, len;
+
+    if (!merger->children) {
+	merger->nodes_capa = 1024;
+	merger->nodes = malloc(merger->nodes_capa * sizeof(stack_node_t));
+	merger->nodes[0].frame = Qnil;
+	merger->nodes[0].parent = 0;
+	merger->nodes_len = 1;
+	merger->children = st_init_numtable();
+    }
 
-    if (_stackprof.raw) {
-	int found = 0;
+    if (RB_TYPE_P(raw_nodes, T_ARRAY) && RB_TYPE_P(raw_samples, T_ARRAY)) {
+	/* nodes only ever refer to nodes before them, so they map in one pass */
+	long count = RARRAY_LEN(raw_nodes) / 2;
+	VALUE buf;
+	unsigned int *map = ALLOCV_N(unsigned int, buf, count + 1);
 
-	if (!_stackprof.raw_samples) {
-	    _stackprof.raw_samples_capa = num * 100;
-	    _stackprof.raw_samples = malloc(sizeof(VALUE) * _stackprof.raw_samples_capa);
+	map[0] = 0;
+	for (n = 1; n <= count; n++) {
+	    unsigned long parent = NUM2ULONG(RARRAY_AREF(raw_nodes, 2*(n-1)));
+	    map[n] = merger_node(merger, map[parent], merger_raw_frame(profile, RARRAY_AREF(raw_nodes, 2*(n-1)+1)));
 	}
 
-	if (_stackprof.raw_samples_capa <= _stackprof.raw_samples_len + num) {
-	    _stackprof.raw_samples_capa *= 2;
-	    _stackprof.raw_samples = realloc(_stackprof.raw_samples, sizeof(VALUE) * _stackprof.raw_samples_capa);
+	len = RARRAY_LEN(raw_samples) / 2;
+	for (n = 0; n < len; n++) {
+	    unsigned long node = NUM2ULONG(RARRAY_AREF(raw_samples, 2*n));
+	    unsigned int thread = 0, tag = 0;
+	    if (RB_TYPE_P(sample_threads, T_ARRAY) && (thread = NUM2UINT(rb_ary_entry(sample_threads, n))))
+		thread += thread_offset;
+	    if (RB_TYPE_P(sample_tags, T_ARRAY) && (tag = NUM2UINT(rb_ary_entry(sample_tags, n))))
+		tag = FIX2UINT(rb_hash_lookup(profile->tags, UINT2NUM(tag)));
+	    merger_push_sample(merger, map[node], RARRAY_AREF(raw_samples, 2*n+1), thread, tag);
 	}
-
-	if (_stackprof.raw_samples_len > 0 && _stackprof.raw_samples[_stackprof.raw_sample_index] == (VALUE)num) {
-	    for (i = num-1, n = 0; i >= 0; i--, n++) {
-		VALUE frame = frames_buffer[i];
-		if (_stackprof.raw_samples[_stackprof.raw_sample_index + 1 + n] != frame)
-		    break;
-	    }
-	    if (i == -1) {
-		_stackprof.raw_samples[_stackprof.raw_samples_len-1] += 1;
-		found = 1;
-	    }
+	ALLOCV_END(buf);
+    } else {
+	/* the flat [len, frames..., weight] layout of older profiles */
+	len = RARRAY_LEN(raw);
+	for (n = 0; n < len; ) {
+	    long depth = NUM2LONG(RARRAY_AREF(raw, n)), i;
+	    unsigned int node = 0;
+
+	    for (i = 1; i <= depth; i++)
+		node = merger_node(merger, node, merger_raw_frame(profile, RARRAY_AREF(raw, n + i)));
+	    merger_push_sample(merger, node, RARRAY_AREF(raw, n + depth + 1), 0, 0);
+	    n += depth + 2;
 	}
+    }
+}
 
-	if (!found) {
-	    _stackprof.raw_sample_index = _stackprof.raw_samples_len;
-	    _stackprof.raw_samples[_stackprof.raw_samples_len++] = (VALUE)num;
-	    for (i = num-1; i >= 0; i--) {
-		VALUE frame = frames_buffer[i];
-		_stackprof.raw_samples[_stackprof.raw_samples_len++] = frame;
-	    }
-	    _stackprof.raw_samples[_stackprof.raw_samples_len++] = (VALUE)1;
-	}
+/* tags are matched on their name, so the same endpoint merges into one */
+static int
+merger_add_tag_i(VALUE index, VALUE details, VALUE arg)
+{
+    merger_profile_t *profile = (merger_profile_t *)arg;
+    merger_t *merger = profile->merger;
+    VALUE name = rb_hash_lookup(details, sym_name), merged, entry;
+
+    if (NIL_P(merged = rb_hash_lookup(merger->tag_indexes, name))) {
+	merged = SIZET2NUM(RHASH_SIZE(merger->tag_indexes) + 1);
+	rb_hash_aset(merger->tag_indexes, name, merged);
+	entry = rb_hash_new();
+	rb_hash_aset(entry, sym_name, name);
+	rb_hash_aset(entry, sym_samples, INT2FIX(0));
+	rb_hash_aset(merger->tags, merged, entry);
     }
+    entry = rb_hash_lookup(merger->tags, merged);
+    rb_hash_aset(entry, sym_samples, SIZET2NUM(merger_count(entry, sym_samples) + merger_count(details, sym_samples)));
+    rb_hash_aset(profile->tags, index, merged);
+    return ST_CONTINUE;
+}
 
-    for (i = 0; i < num; i++) {
-	int line = lines_buffer[i];
-	VALUE frame = frames_buffer[i];
-	frame_data_t *frame_data = sample_for(frame);
+static int
+merger_add_thread_i(VALUE index, VALUE details, VALUE arg)
+{
+    merger_t *merger = (merger_t *)arg;
 
-	frame_data->total_samples++;
+    rb_hash_aset(merger->threads, SIZET2NUM(NUM2SIZET(index) + merger->threads_len), details);
+    return ST_CONTINUE;
+}
 
-	if (i == 0) {
-	    frame_data->caller_samples++;
-	} else if (_stackprof.aggregate) {
-	    if (!frame_data->edges)
-		frame_data->edges = st_init_numtable();
-	    st_numtable_increment(frame_data->edges, (st_data_t)prev_frame, 1);
-	}
+static int
+merger_check_edge_i(VALUE callee, VALUE weight, VALUE arg)
+{
+    NUM2SIZET(weight);
+    return ST_CONTINUE;
+}
 
-	if (_stackprof.aggregate && line > 0) {
-	    if (!frame_data->lines)
-		frame_data->lines = st_init_numtable();
-	    size_t half = (size_t)1<<(8*SIZEOF_SIZE_T/2);
-	    size_t increment = i == 0 ? half + 1 : half;
-	    st_numtable_increment(frame_data->lines, (st_data_t)line, increment);
-	}
+static int
+merger_check_line_i(VALUE line, VALUE weight, VALUE arg)
+{
+    NUM2INT(line);
+    if (RB_TYPE_P(weight, T_ARRAY)) {
+	NUM2ULL(rb_ary_entry(weight, 0));
+	NUM2ULL(rb_ary_entry(weight, 1));
+    } else {
+	NUM2ULL(weight);
+    }
+    return ST_CONTINUE;
+}
 
-	prev_frame = frame;
+static int
+merger_check_frame_i(VALUE id, VALUE info, VALUE arg)
+{
+    VALUE edges, lines, states, bytes;
+    int n;
+
+    if (!RB_TYPE_P(info, T_HASH))
+	rb_raise(rb_eArgError, "malformed frame %"PRIsVALUE, id);
+    merger_count(info, sym_total_samples);
+    merger_count(info, sym_samples);
+    if (!NIL_P(bytes = rb_hash_lookup(info, sym_total_bytes))) {
+	NUM2SIZET(bytes);
+	merger_count(info, sym_bytes);
+    }
+    if (RB_TYPE_P(states = rb_hash_lookup(info, sym_states), T_HASH)) {
+	for (n = 0; n < STATE_COUNT; n++) {
+	    VALUE counts = rb_hash_lookup(states, sym_state_names[n]);
+	    if (RB_TYPE_P(counts, T_ARRAY)) {
+		NUM2SIZET(rb_ary_entry(counts, 0));
+		NUM2SIZET(rb_ary_entry(counts, 1));
+	    }
+	}
     }
+    if (RB_TYPE_P(edges = rb_hash_lookup(info, sym_edges), T_HASH))
+	rb_hash_foreach(edges, merger_check_edge_i, 0);
+    if (RB_TYPE_P(lines = rb_hash_lookup(info, sym_lines), T_HASH))
+	rb_hash_foreach(lines, merger_check_line_i, 0);
+    return ST_CONTINUE;
 }
 
-static void
-stackprof_job_handler(void *data)
+static int
+merger_check_tag_i(VALUE index, VALUE details, VALUE arg)
 {
-    static int in_signal_handler = 0;
-    if (in_signal_handler) return;
-    if (!_stackprof.running) return;
+    if (!RB_TYPE_P(details, T_HASH))
+	rb_raise(rb_eArgError, "malformed tag %"PRIsVALUE, index);
+    merger_count(details, sym_samples);
+    return ST_CONTINUE;
+}
 
-    in_signal_handler++;
-    stackprof_record_sample();
-    in_signal_handler--;
+static int
+merger_check_thread_i(VALUE index, VALUE details, VALUE arg)
+{
+    NUM2SIZET(index);
+    return ST_CONTINUE;
 }
 
 static void
-stackprof_signal_handler(int sig, siginfo_t *sinfo, void *ucontext)
+merger_check_raw_frame(VALUE frames, VALUE frame)
 {
-    _stackprof.overall_signals++;
-    if (rb_during_gc())
-	_stackprof.during_gc++, _stackprof.overall_samples++;
-    else
-	rb_postponed_job_register_one(0, stackprof_job_handler, 0);
+    if (!RB_TYPE_P(frames, T_HASH) || rb_hash_lookup2(frames, frame, Qundef) == Qundef)
+	rb_raise(rb_eArgError, "raw stack references unknown frame %"PRIsVALUE, frame);
 }
 
+/*
+ * Runs every conversion and lookup merger_add relies on, so that a
+ * malformed profile raises before any of it is merged.
+ */
 static void
-stackprof_newobj_handler(VALUE tpval, void *data)
+merger_check(merger_t *merger, VALUE data)
 {
-    _stackprof.overall_signals++;
-    if (RTEST(_stackprof.interval) && _stackprof.overall_signals % NUM2LONG(_stackprof.interval))
+    VALUE frames = rb_hash_lookup(data, sym_frames), tags = rb_hash_lookup(data, sym_tags);
+    VALUE threads = rb_hash_lookup(data, sym_threads), states = rb_hash_lookup(data, sym_states);
+    VALUE raw_nodes = rb_hash_lookup(data, sym_raw_nodes), raw_samples = rb_hash_lookup(data, sym_raw_samples);
+    VALUE raw = rb_hash_lookup(data, sym_raw);
+    long n, len;
+
+    if (merger->profiles) {
+	VALUE mode = rb_hash_lookup(data, sym_mode), interval = rb_hash_lookup(data, sym_interval);
+
+	if (!rb_equal(mode, merger->mode) || !rb_equal(interval, merger->interval))
+	    rb_raise(rb_eArgError, "cannot combine %"PRIsVALUE"(%"PRIsVALUE") with %"PRIsVALUE"(%"PRIsVALUE")",
+		merger->mode, merger->interval, mode, interval);
+    }
+    merger_version(data);
+
+    merger_count(data, sym_samples);
+    merger_count(data, sym_gc_samples);
+    merger_count(data, sym_missed_samples);
+    if (RB_TYPE_P(states, T_HASH))
+	for (n = 0; n < STATE_COUNT; n++)
+	    merger_count(states, sym_state_names[n]);
+    if (RB_TYPE_P(tags, T_HASH))
+	rb_hash_foreach(tags, merger_check_tag_i, 0);
+    if (RB_TYPE_P(frames, T_HASH))
+	rb_hash_foreach(frames, merger_check_frame_i, 0);
+    if (RB_TYPE_P(threads, T_HASH))
+	rb_hash_foreach(threads, merger_check_thread_i, 0);
+
+    if (!merger->raw)
 	return;
-    stackprof_job_handler(0);
+    if (RB_TYPE_P(raw_nodes, T_ARRAY) && RB_TYPE_P(raw_samples, T_ARRAY)) {
+	VALUE sample_threads = rb_hash_lookup(data, sym_raw_sample_threads);
+	VALUE sample_tags = rb_hash_lookup(data, sym_raw_sample_tags);
+	long count = RARRAY_LEN(raw_nodes) / 2;
+
+	for (n = 1; n <= count; n++) {
+	    if ((long)NUM2ULONG(RARRAY_AREF(raw_nodes, 2*(n-1))) >= n)
+		rb_raise(rb_eArgError, "malformed raw_nodes");
+	    merger_check_raw_frame(frames, RARRAY_AREF(raw_nodes, 2*(n-1)+1));
+	}
+	len = RARRAY_LEN(raw_samples) / 2;
+	for (n = 0; n < len; n++) {
+	    unsigned int tag;
+
+	    if (NUM2ULONG(RARRAY_AREF(raw_samples, 2*n)) > (unsigned long)count)
+		rb_raise(rb_eArgError, "malformed raw_samples");
+	    NUM2UINT(RARRAY_AREF(raw_samples, 2*n+1));
+	    if (RB_TYPE_P(sample_threads, T_ARRAY))
+		NUM2UINT(rb_ary_entry(sample_threads, n));
+	    if (RB_TYPE_P(sample_tags, T_ARRAY) && (tag = NUM2UINT(rb_ary_entry(sample_tags, n))) &&
+		(!RB_TYPE_P(tags, T_HASH) || NIL_P(rb_hash_lookup(tags, UINT2NUM(tag)))))
+		rb_raise(rb_eArgError, "raw sample references unknown tag %u", tag);
+	}
+    } else if (RB_TYPE_P(raw, T_ARRAY)) {
+	len = RARRAY_LEN(raw);
+	for (n = 0; n < len; ) {
+	    long depth = NUM2LONG(RARRAY_AREF(raw, n)), i;
+
+	    if (depth < 0 || n + depth + 1 >= len)
+		rb_raise(rb_eArgError, "malformed raw");
+	    for (i = 1; i <= depth; i++)
+		merger_check_raw_frame(frames, RARRAY_AREF(raw, n + i));
+	    NUM2UINT(RARRAY_AREF(raw, n + depth + 1));
+	    n += depth + 2;
+	}
+    }
 }
 
-
-static void
-stackprof_newobj_handler_heap(VALUE tpval, void *data)
+/*
+ *  call-seq:
+ *    merger << profile -> merger
+ *
+ *  Adds a results hash (or anything with a #to_h returning one, like a
+ *  StackProf::BinaryDump). All profiles must share their mode and interval;
+ *  older versions are translated, and versions newer than this stackprof
+ *  writes raise ArgumentError. The result is always of the current version.
+ */
+static VALUE
+merger_add(VALUE self, VALUE data)
 {
-    allocation_info_t *info = NULL, *tmp = NULL;
-    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
-    VALUE obj = rb_tracearg_object(tparg);
-    int num, replace = 0;
+    merger_t *merger;
+    merger_profile_t profile;
+    VALUE frames, threads, states, tags;
+    int n;
+
+    TypedData_Get_Struct(self, merger_t, &merger_type, merger);
+    data = rb_convert_type(data, T_HASH, "Hash", "to_h");
+    merger_check(merger, data);
+
+    if (!merger->profiles++) {
+	merger->mode = rb_hash_lookup(data, sym_mode);
+	merger->interval = rb_hash_lookup(data, sym_interval);
+    }
 
-    _stackprof.overall_signals++;
+    merger->samples += merger_count(data, sym_samples);
+    merger->gc_samples += merger_count(data, sym_gc_samples);
+    merger->missed_samples += merger_count(data, sym_missed_samples);
 
-    if (RTEST(_stackprof.interval) && _stackprof.overall_signals % NUM2LONG(_stackprof.interval))
-	return;
+    if (RB_TYPE_P(states = rb_hash_lookup(data, sym_states), T_HASH)) {
+	merger->states = 1;
+	for (n = 0; n < STATE_COUNT; n++)
+	    merger->state_samples[n] += merger_count(states, sym_state_names[n]);
+    }
 
-    _stackprof.overall_samples++;
+    profile.merger = merger;
+    profile.ids = rb_hash_new();
+    profile.tags = rb_hash_new();
+    profile.frame_data = NULL;
 
-    HASH_FIND(hh, _stackprof.frames_heap_live, &obj, sizeof(VALUE), info);
-    if (!info) {
-        info = (allocation_info_t *)malloc(sizeof(allocation_info_t));
+    if (RB_TYPE_P(tags = rb_hash_lookup(data, sym_tags), T_HASH))
+	rb_hash_foreach(tags, merger_add_tag_i, (VALUE)&profile);
+
+    if (RB_TYPE_P(frames = rb_hash_lookup(data, sym_frames), T_HASH)) {
+	rb_hash_foreach(frames, merger_map_frame_i, (VALUE)&profile);
+	rb_hash_foreach(frames, merger_add_frame_i, (VALUE)&profile);
     }
-    else {
-        free(info->frames);
-        free(info->lines_buffer);
-        replace = 1;
+
+    if (merger->raw) {
+	if ((RB_TYPE_P(rb_hash_lookup(data, sym_raw_nodes), T_ARRAY) && RB_TYPE_P(rb_hash_lookup(data, sym_raw_samples), T_ARRAY)) ||
+	    RB_TYPE_P(rb_hash_lookup(data, sym_raw), T_ARRAY)) {
+	    merger_add_raw(&profile, data);
+	} else {
+	    merger->raw = 0;
+	    merger_release_raw(merger);
+	}
     }
 
-    num = rb_profile_frames(0, sizeof(_stackprof.frames_buffer) / sizeof(VALUE), _stackprof.frames_buffer, _stackprof.lines_buffer);
+    if (RB_TYPE_P(threads = rb_hash_lookup(data, sym_threads), T_HASH)) {
+	rb_hash_foreach(threads, merger_add_thread_i, (VALUE)merger);
+	merger->threads_len += RHASH_SIZE(threads);
+    }
 
-    info->obj = obj;
+    RB_GC_GUARD(data);
+    return self;
+}
 
-    info->num = num;
-    info->living = 1;
-    info->flags = RBASIC(obj)->flags;
-    info->klass = RBASIC_CLASS(obj);
+/* the merger keeps adding up its entries, so results get copies */
+static int
+merger_copy_tag_i(VALUE index, VALUE details, VALUE tags)
+{
+    rb_hash_aset(tags, index, rb_hash_dup(details));
+    return ST_CONTINUE;
+}
 
-    // We will not compute memory used here, we will do it later. It appears
-    // this trace callback is called before the object in question is
-    // populated.
-    info->memsize = 0;
+static VALUE
+merger_frame_key(VALUE id, void *arg)
+{
+    merger_t *merger = arg;
+    return RARRAY_AREF(RARRAY_AREF(merger->infos, FIX2LONG(id) - 1), 3);
+}
 
-    info->frames = (VALUE *)malloc(sizeof(VALUE) * num);
-    MEMCPY(info->frames, _stackprof.frames_buffer, VALUE, num);
+/*
+ *  call-seq:
+ *    merger.result -> hash
+ *
+ *  The merged profile, shaped like StackProf.results. Raw stacks are kept when every profile added
+ *  had them; timestamps and interval history are not merged.
+ */
+static VALUE
+merger_result(VALUE self)
+{
+    merger_t *merger;
+    VALUE results = rb_hash_new(), frames = rb_hash_new();
+    long n;
+    int i;
 
-    info->lines_buffer = (int *)malloc(sizeof(int) * num);
-    MEMCPY(info->lines_buffer, _stackprof.lines_buffer, int, num);
+    TypedData_Get_Struct(self, merger_t, &merger_type, merger);
 
-    if (!replace) {
-        HASH_ADD(hh, _stackprof.frames_heap_live, obj, sizeof(VALUE), info);
-    }
-    else {
-        HASH_REPLACE(hh, _stackprof.frames_heap_live, obj, sizeof(VALUE), info, tmp);
-    }
-}
+    rb_hash_aset(results, sym_version, DBL2NUM(RESULTS_VERSION));
+    rb_hash_aset(results, sym_mode, merger->mode);
+    rb_hash_aset(results, sym_interval, merger->interval);
+    rb_hash_aset(results, sym_samples, SIZET2NUM(merger->samples));
+    rb_hash_aset(results, sym_gc_samples, SIZET2NUM(merger->gc_samples));
+    rb_hash_aset(results, sym_missed_samples, SIZET2NUM(merger->missed_samples));
 
+    if (merger->states) {
+	VALUE states = rb_hash_new();
+	rb_hash_aset(results, sym_states, states);
+	for (i = 0; i < STATE_COUNT; i++)
+	    rb_hash_aset(states, sym_state_names[i], SIZET2NUM(merger->state_samples[i]));
+    }
 
-static void
-stackprof_freeobj_handler_heap(VALUE tpval, void *data)
-{
-    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
-    VALUE obj = rb_tracearg_object(tparg);
-    allocation_info_t *info = NULL;
+    if (merger->threads_len)
+	rb_hash_aset(results, sym_threads, rb_hash_dup(merger->threads));
+    if (RHASH_SIZE(merger->tags)) {
+	VALUE tags = rb_hash_new();
+	rb_hash_foreach(merger->tags, merger_copy_tag_i, tags);
+	rb_hash_aset(results, sym_tags, tags);
+    }
 
-    HASH_FIND(hh, _stackprof.frames_heap_live, &obj, sizeof(VALUE), info);
-    if (info) {
-        // If we are tracking all heap allocations, don't free the
-        // allocation info.
-        if (_stackprof.heap_all)
-        {
-            info->memsize = 0; //get_object_size(obj);
-            info->living = 0;
-        }
-        else
-        {
-            HASH_DEL(_stackprof.frames_heap_live, info);
+    rb_hash_aset(results, sym_frames, frames);
+    for (n = 0; n < RARRAY_LEN(merger->infos); n++) {
+	VALUE info = RARRAY_AREF(merger->infos, n);
+	VALUE details = rb_hash_new();
+
+	rb_hash_aset(frames, RARRAY_AREF(info, 3), details);
+	rb_hash_aset(details, sym_name, RARRAY_AREF(info, 0));
+	rb_hash_aset(details, sym_file, RARRAY_AREF(info, 1));
+	if (!NIL_P(RARRAY_AREF(info, 2)))
+	    rb_hash_aset(details, sym_line, RARRAY_AREF(info, 2));
+	frame_details(details, frame_table_find(merger->frames, LONG2FIX(n + 1)), merger_frame_key, merger);
+    }
 
-            free(info->frames);
-            free(info->lines_buffer);
-            free(info);
+    if (merger->raw && merger->raw_samples_len) {
+	VALUE raw_nodes = rb_ary_new_capa(2 * (merger->nodes_len - 1));
+	VALUE raw_samples = rb_ary_new_capa(2 * merger->raw_samples_len);
+	size_t k;
 
-            // We need to treat this as if we didn't really sample this
-            _stackprof.overall_signals--;
-            _stackprof.overall_samples--;
-        }
+	for (k = 1; k < merger->nodes_len; k++) {
+	    rb_ary_push(raw_nodes, UINT2NUM(merger->nodes[k].parent));
+	    rb_ary_push(raw_nodes, merger_frame_key(merger->nodes[k].frame, merger));
+	}
+	for (k = 0; k < merger->raw_samples_len; k++) {
+	    rb_ary_push(raw_samples, UINT2NUM(merger->raw_samples[k].node));
+	    rb_ary_push(raw_samples, UINT2NUM(merger->raw_samples[k].weight));
+	}
+	rb_hash_aset(results, sym_raw_nodes, raw_nodes);
+	rb_hash_aset(results, sym_raw_samples, raw_samples);
+
+	if (merger->threads_len) {
+	    VALUE threads = rb_ary_new_capa(merger->raw_samples_len);
+	    for (k = 0; k < merger->raw_samples_len; k++)
+		rb_ary_push(threads, UINT2NUM(merger->raw_samples[k].thread));
+	    rb_hash_aset(results, sym_raw_sample_threads, threads);
+	}
+	if (RHASH_SIZE(merger->tags)) {
+	    VALUE tags = rb_ary_new_capa(merger->raw_samples_len);
+	    for (k = 0; k < merger->raw_samples_len; k++)
+		rb_ary_push(tags, UINT2NUM(merger->raw_samples[k].tag));
+	    rb_hash_aset(results, sym_raw_sample_tags, tags);
+	}
     }
+
+    return results;
 }
 
+/*
+ *  call-seq:
+ *    StackProf.merge(*profiles) -> hash
+ *
+ *  Shorthand for adding every profile to a StackProf::Merger.
+ */
 static VALUE
-stackprof_sample(VALUE self)
+stackprof_merge(int argc, VALUE *argv, VALUE self)
 {
-    if (!_stackprof.running)
-	return Qfalse;
+    VALUE merger = rb_class_new_instance(0, NULL, rb_const_get(rb_mStackProf, rb_intern("Merger")));
+    int n;
 
-    _stackprof.overall_signals++;
-    stackprof_job_handler(0);
-    return Qtrue;
+    for (n = 0; n < argc; n++)
+	merger_add(merger, argv[n]);
+    return merger_result(merger);
 }
 
-static int
-frame_mark_i(st_data_t key, st_data_t val, st_data_t arg)
-{
-    VALUE frame = (VALUE)key;
-    rb_gc_mark(frame);
-    return ST_CONTINUE;
-}
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * StackProf::MappedFile is a read-only memory mapping of a dump, so that
+ * StackProf::BinaryDump only pages in the sections it actually decodes. It
+ * quacks like the String it replaces: #bytesize and #byteslice.
+ */
+typedef struct {
+    char *addr;
+    size_t len;
+} mapped_file_t;
 
 static void
-stackprof_gc_mark(void *data)
+mapped_file_free(void *ptr)
 {
-    allocation_info_t *info, *tmp;
-    int i;
-
-    if (RTEST(_stackprof.out))
-	rb_gc_mark(_stackprof.out);
+    mapped_file_t *map = ptr;
 
-    if (_stackprof.frames)
-	st_foreach(_stackprof.frames, frame_mark_i, 0);
+    if (map->addr)
+	munmap(map->addr, map->len);
+    xfree(map);
+}
 
-    if (_stackprof.frames_heap_live) {
-        HASH_ITER(hh, _stackprof.frames_heap_live, info, tmp) {
-            if (info->frames) {
-                for (i = 0; i < info->num; i++) {
-                    rb_gc_mark(info->frames[i]);
-                }
-            }
-        }
-        //st_foreach(_stackprof.frames_heap_live, heap_frame_mark_i, 0);
-    }
+static size_t
+mapped_file_memsize(const void *ptr)
+{
+    return sizeof(mapped_file_t);
 }
 
-static void
-stackprof_atfork_prepare(void)
+static const rb_data_type_t mapped_file_type = {
+    "StackProf::MappedFile",
+    { NULL, mapped_file_free, mapped_file_memsize, NULL },
+    NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+mapped_file_alloc(VALUE klass)
 {
-    struct itimerval timer;
-    if (_stackprof.running) {
-	if (_stackprof.mode == sym_wall || _stackprof.mode == sym_cpu) {
-	    memset(&timer, 0, sizeof(timer));
-	    setitimer(_stackprof.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
-	}
-    }
+    mapped_file_t *map;
+    return TypedData_Make_Struct(klass, mapped_file_t, &mapped_file_type, map);
 }
 
-static void
-stackprof_atfork_parent(void)
+static VALUE
+mapped_file_initialize(VALUE self, VALUE path)
 {
-    struct itimerval timer;
-    if (_stackprof.running) {
-	if (_stackprof.mode == sym_wall || _stackprof.mode == sym_cpu) {
-	    timer.it_interval.tv_sec = 0;
-	    timer.it_interval.tv_usec = NUM2LONG(_stackprof.interval);
-	    timer.it_value = timer.it_interval;
-	    setitimer(_stackprof.mode == sym_wall ? ITIMER_REAL : ITIMER_PROF, &timer, 0);
+    mapped_file_t *map;
+    struct stat st;
+    int fd;
+
+    TypedData_Get_Struct(self, mapped_file_t, &mapped_file_type, map);
+    FilePathValue(path);
+
+    if ((fd = open(StringValueCStr(path), O_RDONLY)) < 0)
+	rb_sys_fail_str(path);
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	rb_sys_fail_str(path);
+    }
+
+    if (st.st_size > 0) {
+	void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+	    close(fd);
+	    rb_sys_fail_str(path);
 	}
+	map->addr = addr;
+	map->len = (size_t)st.st_size;
     }
+    close(fd);
+
+    return self;
 }
 
-static void
-stackprof_atfork_child(void)
+static VALUE
+mapped_file_bytesize(VALUE self)
 {
-    allocation_info_t *info, *tmp;
+    mapped_file_t *map;
 
-    if (_stackprof.running) {
-        if (_stackprof.mode == sym_heap) {
-            HASH_ITER(hh, _stackprof.frames_heap_live, info, tmp) {
-                HASH_DEL(_stackprof.frames_heap_live, info);
+    TypedData_Get_Struct(self, mapped_file_t, &mapped_file_type, map);
+    return SIZET2NUM(map->len);
+}
 
-                free(info->frames);
-                free(info->lines_buffer);
-                free(info);
-            }
-        }
-    }
+static VALUE
+mapped_file_byteslice(VALUE self, VALUE offset, VALUE length)
+{
+    mapped_file_t *map;
+    size_t off = NUM2SIZET(offset), len = NUM2SIZET(length);
 
-    stackprof_stop(rb_mStackProf);
+    TypedData_Get_Struct(self, mapped_file_t, &mapped_file_type, map);
+    if (off > map->len)
+	return Qnil;
+    if (len > map->len - off)
+	len = map->len - off;
+    return rb_str_new(map->addr + off, len);
 }
+#endif
 
 void
 Init_stackprof(void)
 {
     VALUE gc_constant;
+
+#ifdef HAVE_RB_POSTPONED_JOB_PREREGISTER
+    job_handle = rb_postponed_job_preregister(0, stackprof_job_dispatch, 0);
+    if (job_handle == POSTPONED_JOB_HANDLE_INVALID)
+	rb_raise(rb_eRuntimeError, "stackprof: no room left in the postponed job table");
+#endif
 #define S(name) sym_##name = ID2SYM(rb_intern(#name));
     S(object);
     S(custom);
@@ -736,10 +4106,66 @@ Init_stackprof(void)
     S(frames);
     S(aggregate);
     S(heap_all);
+    S(buffered);
+    S(per_thread);
+    S(raw_sample_threads);
+    S(threads);
+    S(thread_id);
+    S(fiber_id);
+    S(native_thread_id);
+    S(states);
+    S(ignore_gc);
+    S(state);
+    S(marking);
+    S(sweeping);
+    S(overhead);
+    S(interval_history);
+    S(bytes);
+    S(total_bytes);
+    S(random);
+    S(timestamps);
+    S(raw_timestamp_deltas);
+    S(raw_start_timestamp);
+    S(raw_start_time);
+    S(running);
+    S(signals);
+    S(jobs);
+    S(job_time_ns);
+    S(job_register_failures);
+    S(reentrant_drops);
+    S(ring_overflows);
+    S(frames_capa);
+    S(frames_load);
+    S(raw_bytes);
+    S(heap_live);
+    S(heap_stacks);
+    S(follow_fork);
+    S(symbolize);
+    S(symbols);
+    S(symbols_pending);
+    S(pid);
+    S(tags);
+    S(raw_sample_tags);
+    sym_state_names[STATE_RUNNING] = ID2SYM(rb_intern("running"));
+    sym_state_names[STATE_GVL_WAIT] = ID2SYM(rb_intern("gvl_wait"));
+    sym_state_names[STATE_BLOCKED] = ID2SYM(rb_intern("blocked"));
+    sym_state_names[STATE_GC] = ID2SYM(rb_intern("gc"));
+    S(raw_nodes);
+    S(raw_samples);
+    S(format);
+    S(marshal);
+    S(binary);
 #undef S
 
     gc_hook = Data_Wrap_Struct(rb_cObject, stackprof_gc_mark, NULL, &_stackprof);
     rb_global_variable(&gc_hook);
+    tag_indexes = rb_hash_new();
+    rb_global_variable(&tag_indexes);
+    tag_names = rb_ary_new();
+    rb_global_variable(&tag_names);
+    rb_global_variable(&symbols.strings);
+    rb_global_variable(&symbols.index);
+    symbol_table_clear();
 
     rb_mStackProf = rb_define_module("StackProf");
     rb_define_singleton_method(rb_mStackProf, "running?", stackprof_running_p, 0);
@@ -747,7 +4173,28 @@ Init_stackprof(void)
     rb_define_singleton_method(rb_mStackProf, "start", stackprof_start, -1);
     rb_define_singleton_method(rb_mStackProf, "stop", stackprof_stop, 0);
     rb_define_singleton_method(rb_mStackProf, "results", stackprof_results, -1);
+    rb_define_singleton_method(rb_mStackProf, "snapshot", stackprof_snapshot, -1);
     rb_define_singleton_method(rb_mStackProf, "sample", stackprof_sample, 0);
+    rb_define_singleton_method(rb_mStackProf, "stats", stackprof_stats, 0);
+    rb_define_singleton_method(rb_mStackProf, "with_tag", stackprof_with_tag, 1);
+    rb_define_singleton_method(rb_mStackProf, "merge", stackprof_merge, -1);
+
+    {
+	VALUE cMerger = rb_define_class_under(rb_mStackProf, "Merger", rb_cObject);
+	rb_define_alloc_func(cMerger, merger_alloc);
+	rb_define_method(cMerger, "<<", merger_add, 1);
+	rb_define_method(cMerger, "result", merger_result, 0);
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+    {
+	VALUE cMappedFile = rb_define_class_under(rb_mStackProf, "MappedFile", rb_cObject);
+	rb_define_alloc_func(cMappedFile, mapped_file_alloc);
+	rb_define_method(cMappedFile, "initialize", mapped_file_initialize, 1);
+	rb_define_method(cMappedFile, "bytesize", mapped_file_bytesize, 0);
+	rb_define_method(cMappedFile, "byteslice", mapped_file_byteslice, 2);
+    }
+#endif
 
     // For Ruby <= 2.1.*, RVALUE size is not included when computing
     // memsize_of(obj), so we will add it explicitly.
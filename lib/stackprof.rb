@@ -2,3 +2,7 @@ require "stackprof/stackprof"
 
 StackProf.autoload :Report, "stackprof/report.rb"
 StackProf.autoload :Middleware, "stackprof/middleware.rb"
+StackProf.autoload :BinaryDump, "stackprof/binary_dump.rb"
+StackProf.autoload :Writer, "stackprof/writer.rb"
+StackProf.autoload :Diff, "stackprof/diff.rb"
+StackProf.autoload :Pprof, "stackprof/pprof.rb"
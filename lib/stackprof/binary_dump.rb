@@ -0,0 +1,259 @@
+module StackProf
+  # Reader for the binary dump format written by StackProf.results when the
+  # profiler was started with <tt>format: :binary</tt>. See stackprof.c for
+  # the layout. The file is split into sections up front; each section is
+  # only decoded the first time one of its keys is read, and frames are
+  # only turned into hashes when looked up.
+  class BinaryDump
+    MAGIC = "STACKPRF".b
+
+    # Raised for a dump whose sections or tables run past their bounds, as
+    # a truncated file's do.
+    class FormatError < ArgumentError; end
+
+    # bytes per record of each table section
+    WIDTHS = {
+      'FRMS' => 80, 'NODS' => 16, 'SMPL' => 8, 'THRD' => 4, 'TAGS' => 4,
+      'TMST' => 4, 'EDGS' => 16, 'LINS' => 24, 'BYTS' => 16, 'STAT' => 64,
+    }
+
+    def self.binary?(buffer)
+      buffer.byteslice(0, MAGIC.bytesize) == MAGIC
+    end
+
+    def self.binary_file?(path)
+      File.open(path, 'rb'){ |f| binary?(f.read(MAGIC.bytesize) || '') }
+    end
+
+    # Maps the file when the extension supports it, so only the sections
+    # that get decoded are paged in.
+    def self.load(path)
+      new(defined?(MappedFile) ? MappedFile.new(path) : IO.binread(path))
+    end
+
+    # +source+ is the dump as a String, or anything else that responds to
+    # #bytesize and #byteslice (like StackProf::MappedFile).
+    def initialize(source)
+      raise ArgumentError, "not a stackprof binary dump" unless self.class.binary?(source)
+
+      @source = source
+      @sections = {}
+      @counts = {}
+      pos = MAGIC.bytesize
+      size = @source.bytesize
+      while pos < size
+        raise FormatError, "truncated section header at #{pos}" if pos + 16 > size
+        tag = @source.byteslice(pos, 4)
+        len = @source.byteslice(pos + 8, 8).unpack('Q<').first
+        raise FormatError, "#{tag} section runs past the end of the dump" if len > size - pos - 16
+        if width = WIDTHS[tag]
+          count = len >= 8 ? @source.byteslice(pos + 16, 8).unpack('Q<').first : nil
+          raise FormatError, "#{tag} table runs past its section" unless count && count <= (len - 8) / width
+          @counts[tag] = count
+        end
+        @sections[tag] = [pos + 16, len]
+        pos += 16 + len
+      end
+      @data = {}
+    end
+
+    def [](key)
+      return @data[key] if @data.key?(key)
+      @data[key] = case key
+                   when :frames      then FrameTable.new(self)
+                   when :raw_nodes   then read_table('NODS', 'Q<*', 16)
+                   when :raw_samples then read_table('SMPL', 'L<*', 8)
+                   when :raw_sample_threads then read_table('THRD', 'L<*', 4)
+                   when :raw_sample_tags then read_table('TAGS', 'L<*', 4)
+                   when :raw_timestamp_deltas then read_table('TMST', 'L<*', 4)
+                   else meta[key]
+                   end
+    end
+
+    def []=(key, value)
+      @data[key] = value
+    end
+
+    def key?(key)
+      !self[key].nil?
+    end
+    alias include? key?
+
+    def to_h
+      hash = meta.dup
+      hash[:frames] = self[:frames].to_h
+      [:raw_nodes, :raw_samples, :raw_sample_threads, :raw_sample_tags, :raw_timestamp_deltas].each do |key|
+        hash[key] = self[key] if self[key]
+      end
+      hash
+    end
+
+    def meta
+      @meta ||= (section = read_section('META')) ? Marshal.load(section) : {}
+    end
+
+    def read_section(tag)
+      if location = @sections[tag]
+        @source.byteslice(*location)
+      end
+    end
+
+    # Decodes the fixed-width records of a section, without its count.
+    def read_table(tag, format, width, first = 0, count = nil)
+      return unless location = @sections[tag]
+      offset, _ = location
+      count ||= @counts[tag] - first
+      raise FormatError, "#{tag} records #{first}...#{first + count} out of range" if first < 0 || count < 0 || first + count > @counts[tag]
+      @source.byteslice(offset + 8 + first * width, count * width).unpack(format)
+    end
+
+    def strings
+      @strings ||= begin
+        section = read_section('STRS') || ''.b
+        raise FormatError, "truncated STRS section" if section.bytesize < 8
+        count = section.unpack('Q<').first
+        list = [nil]
+        pos = 8
+        count.times do
+          raise FormatError, "STRS section runs short of #{count} strings" if pos + 4 > section.bytesize
+          len = section.byteslice(pos, 4).unpack('L<').first
+          raise FormatError, "STRS section runs short of #{count} strings" if pos + 4 + len > section.bytesize
+          list << section.byteslice(pos + 4, len).force_encoding(Encoding::UTF_8)
+          pos += 4 + len
+        end
+        list
+      end
+    end
+
+    # Hash-like view of the frame table. Only the fixed-width columns are
+    # decoded up front; a frame's hash (with its edges and lines) is built
+    # the first time it's looked up and then kept.
+    class FrameTable
+      include Enumerable
+
+      FIELDS = 10
+      STATES = [:running, :gvl_wait, :blocked, :gc]
+      ID, NAME, FILE, LINE, TOTAL, SAMPLES, EDGE_START, EDGE_COUNT, LINE_START, LINE_COUNT = (0...FIELDS).to_a
+
+      def initialize(dump)
+        @dump = dump
+        @columns = dump.read_table('FRMS', 'Q<*', 80) || []
+        @index = {}
+        (@columns.size / FIELDS).times{ |i| @index[@columns[i*FIELDS + ID]] = i }
+        @frames = {}
+      end
+
+      def size
+        @index.size
+      end
+
+      def keys
+        @index.keys
+      end
+
+      def key?(id)
+        @index.key?(id)
+      end
+      alias include? key?
+
+      def [](id)
+        @frames[id] ||= (i = @index[id]) && build(i)
+      end
+
+      def each
+        return enum_for(:each) unless block_given?
+        @index.each_key{ |id| yield id, self[id] }
+      end
+
+      def each_value(&block)
+        each{ |_, frame| block.call(frame) }
+      end
+
+      def values
+        map{ |_, frame| frame }
+      end
+
+      def to_h
+        inject({}){ |h, (id, frame)| h[id] = frame; h }
+      end
+
+      def field(id, field)
+        @columns[@index[id]*FIELDS + field]
+      end
+
+      # Frame ids ordered by descending +samples+ (or +total_samples+),
+      # ties in table order, without building frame hashes.
+      def sorted_ids(sort_by_total=false)
+        field = sort_by_total ? TOTAL : SAMPLES
+        @index.sort_by{ |id, i| [-@columns[i*FIELDS + field], i] }.map(&:first)
+      end
+
+      def ids_matching_name(pattern)
+        strings = @dump.strings
+        @index.keys.select{ |id| strings[field(id, NAME)] =~ pattern }
+      end
+
+      # callee id => [[caller id, weight], ...], from the edges section alone
+      def callers
+        @callers ||= begin
+          edges = @dump.read_table('EDGS', 'Q<*', 16) || []
+          callers = Hash.new{ |h, k| h[k] = [] }
+          @index.each do |id, i|
+            start, count = @columns[i*FIELDS + EDGE_START], @columns[i*FIELDS + EDGE_COUNT]
+            count.times do |n|
+              callers[edges[2*(start + n)]] << [id, edges[2*(start + n) + 1]]
+            end
+          end
+          callers
+        end
+      end
+
+      # file => { line => [total, samples] }, from the lines section alone
+      def file_lines
+        lines = @dump.read_table('LINS', 'Q<*', 24) || []
+        strings = @dump.strings
+        @index.each_value.inject({}) do |hash, i|
+          file, start, count = @columns[i*FIELDS + FILE], @columns[i*FIELDS + LINE_START], @columns[i*FIELDS + LINE_COUNT]
+          if file > 0 && count > 0
+            file_hash = hash[strings[file]] ||= {}
+            count.times do |n|
+              line, total, samples = lines[3*(start + n), 3]
+              if prev = file_hash[line]
+                prev[0] += total
+                prev[1] += samples
+              else
+                file_hash[line] = [total, samples]
+              end
+            end
+          end
+          hash
+        end
+      end
+
+      private
+
+      def build(i)
+        row = @columns[i*FIELDS, FIELDS]
+        strings = @dump.strings
+        frame = { name: strings[row[NAME]], file: strings[row[FILE]] }
+        frame[:line] = row[LINE] if row[LINE] > 0
+        frame[:total_samples] = row[TOTAL]
+        frame[:samples] = row[SAMPLES]
+        if row[EDGE_COUNT] > 0
+          frame[:edges] = Hash[*@dump.read_table('EDGS', 'Q<*', 16, row[EDGE_START], row[EDGE_COUNT])]
+        end
+        if row[LINE_COUNT] > 0
+          lines = @dump.read_table('LINS', 'Q<*', 24, row[LINE_START], row[LINE_COUNT])
+          frame[:lines] = lines.each_slice(3).inject({}){ |h, (line, total, samples)| h[line] = [total, samples]; h }
+        end
+        if bytes = @dump.read_table('BYTS', 'Q<*', 16, i, 1)
+          frame[:total_bytes], frame[:bytes] = bytes
+        end
+        if states = @dump.read_table('STAT', 'Q<*', 16 * STATES.size, i, 1)
+          frame[:states] = STATES.zip(states.each_slice(2)).inject({}){ |h, (state, counts)| h[state] = counts if counts[0] > 0; h }
+        end
+        frame
+      end
+    end
+  end
+end
@@ -0,0 +1,126 @@
+module StackProf
+  # Compares two profiles of the same mode, say before and after a deploy.
+  # Both go through StackProf.merge first, so their frames line up on their
+  # stable ids whichever version wrote them. A frame's samples are taken as
+  # a share (in percent) of its profile's samples, so profiles of different
+  # lengths or intervals compare, and its change only counts as significant
+  # if a two-proportion z-test on those shares scores at least +threshold+.
+  class Diff
+    attr_reader :base, :data, :threshold
+
+    def initialize(base, other, threshold: 3.0)
+      @base, @data = [base, other].map{ |profile| StackProf.merge(profile.is_a?(Report) ? profile.data : profile) }
+      raise ArgumentError, "cannot compare #{@base[:mode]} with #{@data[:mode]}" unless @base[:mode] == @data[:mode]
+      @threshold = threshold
+    end
+
+    # Every frame of either profile, as a hash of its name, file and line,
+    # its share of total and self samples in each profile (:base_total,
+    # :base_samples, :total, :samples), the change in each (:total_delta,
+    # :samples_delta) and the z score of the one sorted by. Largest changes
+    # first.
+    def frames(sort_by_total=false)
+      @frames ||= {}
+      @frames[sort_by_total] ||= begin
+        key = sort_by_total ? :total_samples : :samples
+        delta = sort_by_total ? :total_delta : :samples_delta
+        base_samples, samples = @base[:samples], @data[:samples]
+
+        (@base[:frames].keys | @data[:frames].keys).map do |id|
+          was, now = @base[:frames][id], @data[:frames][id]
+          info = now || was
+          frame = {
+            id: id, name: info[:name], file: info[:file], line: info[:line],
+            base_total: share(was, :total_samples, base_samples), base_samples: share(was, :samples, base_samples),
+            total: share(now, :total_samples, samples), samples: share(now, :samples, samples),
+            z: z_score(was ? was[key] : 0, base_samples, now ? now[key] : 0, samples)
+          }
+          frame[:total_delta] = frame[:total] - frame[:base_total]
+          frame[:samples_delta] = frame[:samples] - frame[:base_samples]
+          frame
+        end.sort_by{ |frame| [-frame[delta].abs, frame[:name]] }
+      end
+    end
+
+    # The frames whose change is beyond the noise.
+    def significant_frames(sort_by_total=false)
+      frames(sort_by_total).select{ |frame| frame[:z].abs >= @threshold }
+    end
+
+    def print_text(sort_by_total=false, limit=nil, f = STDOUT)
+      list = significant_frames(sort_by_total)
+      f.puts "=================================="
+      f.puts "  Mode: #{modeline(@base)} -> #{modeline(@data)}"
+      f.puts "  Samples: #{@base[:samples]} -> #{@data[:samples]}"
+      f.puts "  Changed: #{list.size} of #{frames(sort_by_total).size} frames (|z| >= #{@threshold})"
+      f.puts "=================================="
+      f.printf "% 10s    (base)  % 10s    (base)     FRAME\n" % ["TOTAL", "SAMPLES"]
+      list = list.first(limit) if limit
+      list.each do |frame|
+        f.printf "% 10s % 9s  % 10s % 9s     %s\n",
+          "%+.1f%%" % frame[:total_delta], "(%.1f%%)" % frame[:base_total],
+          "%+.1f%%" % frame[:samples_delta], "(%.1f%%)" % frame[:base_samples], frame[:name]
+      end
+    end
+
+    # Both profiles' raw stacks in the "stack base new" format of
+    # difffolded.pl, for differential flamegraphs with flamegraph.pl. Base
+    # counts are scaled to the new profile's samples.
+    def print_stackcollapse(f = STDOUT)
+      counts = Hash.new{ |h, line| h[line] = [0, 0] }
+      Report.new(@base).each_stackcollapse{ |line, weight| counts[line][0] += weight }
+      Report.new(@data).each_stackcollapse{ |line, weight| counts[line][1] += weight }
+      scale = @base[:samples] > 0 ? @data[:samples].fdiv(@base[:samples]) : 1
+      counts.each{ |line, (was, now)| f.puts "#{line} #{(was * scale).round} #{now}" }
+    end
+
+    # Call graph of the significant frames, red where their share of total
+    # samples grew and blue where it shrank.
+    def print_graphviz(options = {}, f = STDOUT)
+      list = significant_frames(true)
+      list = list.first(options[:limit]) if options[:limit]
+      included = list.each_with_object({}){ |frame, h| h[frame[:id]] = true }
+
+      f.puts "digraph profile {"
+      f.puts "Legend [shape=box,fontsize=24,shape=plaintext,label=\""
+      f.print "Samples: #{@base[:samples]} -> #{@data[:samples]}\\l"
+      f.print "Showing #{list.size} frames changed with |z| >= #{@threshold}\\l"
+      f.puts "\"];"
+
+      list.each do |frame|
+        color = frame[:total_delta] > 0 ? 'red' : 'blue'
+        size = frame[:total_delta].abs / 25.0 + 0.5
+        label = "%.1f%% -> %.1f%% of samples\\r" % [frame[:base_total], frame[:total]]
+        f.puts "  \"#{frame[:id]}\" [shape=box] [color=#{color}] [penwidth=\"#{size}\"] [label=\"#{frame[:name]}\\n#{label}\"];"
+      end
+
+      list.each do |frame|
+        was = (@base[:frames][frame[:id]] || {})[:edges] || {}
+        now = (@data[:frames][frame[:id]] || {})[:edges] || {}
+        (was.keys | now.keys).each do |callee|
+          next unless included[callee]
+          change = 100.0 * (now[callee] || 0) / [@data[:samples], 1].max - 100.0 * (was[callee] || 0) / [@base[:samples], 1].max
+          f.puts "  \"#{frame[:id]}\" -> \"#{callee}\" [label=\"%+.1f%%\"] [color=#{change > 0 ? 'red' : 'blue'}];" % change
+        end
+      end
+      f.puts "}"
+    end
+
+    private
+
+    def modeline(data)
+      "#{data[:mode]}(#{data[:interval]})"
+    end
+
+    def share(frame, key, samples)
+      frame && samples > 0 ? 100.0 * frame[key] / samples : 0.0
+    end
+
+    def z_score(was, base_samples, now, samples)
+      return 0.0 if base_samples == 0 || samples == 0
+      pooled = [(was + now).fdiv(base_samples + samples), 1.0].min
+      error = Math.sqrt(pooled * (1 - pooled) * (1.0 / base_samples + 1.0 / samples))
+      error > 0 ? (now.fdiv(samples) - was.fdiv(base_samples)) / error : 0.0
+    end
+  end
+end
@@ -12,16 +12,27 @@ module StackProf
       Middleware.raw      = options[:raw] || false
       Middleware.enabled  = options[:enabled]
       Middleware.path     = options[:path] || 'tmp'
-      at_exit{ Middleware.save } if options[:save_at_exit]
+      Middleware.continuous = options[:continuous] || false
+      Middleware.tag      = options[:tag]
+      Middleware.writer   = options[:async] ? Writer.new(max_pending: options[:max_pending] || 2) : nil
+      at_exit{ Middleware.save; Middleware.writer && Middleware.writer.close } if options[:save_at_exit]
     end
 
     def call(env)
       enabled = Middleware.enabled?(env)
-      StackProf.start(mode: Middleware.mode, interval: Middleware.interval, raw: Middleware.raw) if enabled
-      @app.call(env)
+      StackProf.start(mode: Middleware.mode, interval: Middleware.interval, raw: Middleware.raw, symbolize: Middleware.continuous) if enabled
+      if enabled && (tag = Middleware.tag_for(env))
+        # samples taken during the request are labelled with it, so one
+        # continuous profile can be sliced per endpoint with Report#tag_report
+        StackProf.with_tag(tag){ @app.call(env) }
+      else
+        @app.call(env)
+      end
     ensure
       if enabled
-        StackProf.stop
+        # in continuous mode the profiler is left running between requests,
+        # and save takes a snapshot of it instead
+        StackProf.stop unless Middleware.continuous
         if @num_reqs && (@num_reqs-=1) == 0
           @num_reqs = @options[:save_every]
           Middleware.save
@@ -30,7 +41,7 @@ module StackProf
     end
 
     class << self
-      attr_accessor :enabled, :mode, :interval, :raw, :path
+      attr_accessor :enabled, :mode, :interval, :raw, :path, :continuous, :writer, :tag
 
       def enabled?(env)
         if enabled.respond_to?(:call)
@@ -40,12 +51,21 @@ module StackProf
         end
       end
 
+      def tag_for(env)
+        tag.respond_to?(:call) ? tag.call(env) : tag
+      end
+
       def save(filename = nil)
-        if results = StackProf.results
-          FileUtils.mkdir_p(Middleware.path)
+        if results = (continuous ? StackProf.snapshot : StackProf.results)
           filename ||= "stackprof-#{results[:mode]}-#{Process.pid}-#{Time.now.to_i}.dump"
-          File.open(File.join(Middleware.path, filename), 'wb') do |f|
-            f.write Marshal.dump(results)
+          if writer
+            # serialized and written off the request path
+            writer.write(File.join(Middleware.path, filename), results)
+          else
+            FileUtils.mkdir_p(Middleware.path)
+            File.open(File.join(Middleware.path, filename), 'wb') do |f|
+              f.write Marshal.dump(results)
+            end
           end
           filename
         end
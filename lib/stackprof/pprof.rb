@@ -0,0 +1,115 @@
+require 'zlib'
+
+module StackProf
+  # Writes the raw stacks of a report as a gzipped pprof Profile message
+  # (github.com/google/pprof, proto/profile.proto), encoded by hand so
+  # there's no protobuf dependency. There's one Function and one Location
+  # per frame, and one Sample per distinct stack and thread, built walking
+  # the stack trie from the leaf up the way pprof lists locations. Samples
+  # are written as they're produced; only the frame tables and the string
+  # table are kept, and go last.
+  class Pprof
+    def initialize(report)
+      @report = report
+      @data = report.data
+    end
+
+    def write(io)
+      @strings = { "" => 0 }
+      @locations = {} # frame id => location id
+      gz = Zlib::GzipWriter.new(io)
+
+      types = sample_types
+      types.each{ |type, unit| gz.write message(1, value_type(type, unit)) }
+      each_sample do |locations, weight, thread|
+        values = [weight]
+        values << weight * @data[:interval] * 1000 if types.size > 1
+        sample = packed(1, locations) + packed(2, values)
+        sample << message(3, int(1, string("thread")) + int(3, thread)) if thread
+        gz.write message(2, sample)
+      end
+
+      @locations.each do |frame_id, id|
+        frame = @data[:frames][frame_id]
+        gz.write message(5, int(1, id) + int(2, string(frame[:name])) + int(3, string(frame[:name])) +
+          int(4, string(frame[:file])) + int(5, frame[:line] || 0))
+        gz.write message(4, int(1, id) + message(4, int(1, id) + int(2, frame[:line] || 0)))
+      end
+
+      if mode = types[1]
+        gz.write message(11, value_type(*mode))
+        gz.write int(12, @data[:interval] * 1000)
+      end
+      gz.write int(9, (@data[:raw_start_time] * 1e9).to_i) if @data[:raw_start_time]
+
+      @strings.each_key{ |str| gz.write bytes(6, str) }
+      gz.finish
+    end
+
+    private
+
+    def sample_types
+      case @data[:mode]
+      when :wall, :cpu then [["samples", "count"], [@data[:mode].to_s, "nanoseconds"]]
+      when :object, :heap then [["objects", "count"]]
+      else [["samples", "count"]]
+      end
+    end
+
+    # Yields the location ids of each distinct stack, leaf first, with its
+    # summed weight and thread.
+    def each_sample
+      if nodes = @data[:raw_nodes]
+        samples, threads = @data[:raw_samples], @data[:raw_sample_threads]
+        weights = Hash.new(0)
+        (samples.size / 2).times{ |i| weights[[samples[2*i], threads && threads[i]]] += samples[2*i + 1] }
+        weights.each do |(node, thread), weight|
+          locations = []
+          while node > 0
+            locations << location(nodes[2*node - 1])
+            node = nodes[2*node - 2]
+          end
+          yield locations, weight, thread
+        end
+      else
+        @report.each_raw_sample do |frames, weight, thread|
+          yield frames.reverse_each.map{ |frame| location(frame) }, weight, thread
+        end
+      end
+    end
+
+    def location(frame_id)
+      @locations[frame_id] ||= @locations.size + 1
+    end
+
+    def string(str)
+      @strings[str.to_s] ||= @strings.size
+    end
+
+    def value_type(type, unit)
+      int(1, string(type)) + int(2, string(unit))
+    end
+
+    def varint(n)
+      out = String.new(encoding: Encoding::BINARY)
+      while n >= 0x80
+        out << ((n & 0x7f) | 0x80)
+        n >>= 7
+      end
+      out << n
+    end
+
+    def int(field, n)
+      varint(field << 3) << varint(n)
+    end
+
+    def bytes(field, str)
+      varint(field << 3 | 2) << varint(str.bytesize) << str.b
+    end
+    alias message bytes
+
+    def packed(field, ints)
+      bytes(field, ints.inject(String.new(encoding: Encoding::BINARY)){ |out, n| out << varint(n) })
+    end
+  end
+end
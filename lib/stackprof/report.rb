@@ -1,15 +1,113 @@
 require 'pp'
+require 'json'
 require 'digest/md5'
 
 module StackProf
   class Report
+    # Loads a dump written by StackProf.results, in either the Marshal or
+    # the binary format.
+    # Binary dumps are opened lazily, so only the frames a report
+    # actually prints get decoded.
+    def self.load(path)
+      new(BinaryDump.binary_file?(path) ? BinaryDump.load(path) : Marshal.load(IO.binread(path)))
+    end
+
+    # Combines any number of reports (or results hashes) into one with
+    # StackProf::Merger, matching frames on their name, file and line.
+    def self.merge(reports)
+      merger = Merger.new
+      reports.each{ |report| merger << (report.is_a?(Report) ? report.data : report) }
+      new(merger.result)
+    end
+
+    # Loads dumps and merges them into one results hash, or nil if none
+    # could be read. With +jobs+ above 1 the paths are split into that many
+    # contiguous slices, each loaded and merged in a forked worker, and the
+    # partial results merged in order: frames, edges and raw nodes then come
+    # out in the same order, so the profile equals the sequential one.
+    # Dumps that fail to parse (TypeError or ArgumentError, which covers
+    # BinaryDump::FormatError) or that the merger refuses are passed to the
+    # block with the error, if given; the merge goes on without them. Workers
+    # send their failures back with their partial results, so the block
+    # always runs in the calling process, in path order.
+    def self.load_merged(paths, jobs: 1, &on_error)
+      jobs = [jobs, paths.size].min
+      return merge_files(paths, &on_error) unless jobs > 1 && Process.respond_to?(:fork)
+
+      workers = paths.each_slice((paths.size + jobs - 1) / jobs).map do |slice|
+        reader, writer = IO.pipe
+        pid = fork do
+          reader.close
+          failures = []
+          result = begin
+            if on_error
+              merge_files(slice){ |path, e| failures << [path, e] }
+            else
+              merge_files(slice)
+            end
+          rescue => e
+            e
+          end
+          Marshal.dump([result, failures], writer.binmode)
+          writer.close
+          exit!(0)
+        end
+        writer.close
+        [pid, reader, slice]
+      end
+
+      merger, loaded = Merger.new, false
+      workers.each do |pid, reader, slice|
+        result, failures = Marshal.load(reader.binmode)
+        reader.close
+        Process.wait(pid)
+        raise result if result.is_a?(Exception)
+        begin
+          merger << result if result
+        rescue ArgumentError
+          # the slice holds the first profile of a mode (or version) the
+          # earlier slices don't share: redo it a file at a time, so the
+          # blame lands on the same files as a sequential merge
+          raise unless on_error
+          loaded |= merge_into(merger, slice, &on_error)
+          next
+        end
+        loaded ||= !result.nil?
+        failures.each{ |path, e| on_error.call(path, e) }
+      end
+      merger.result if loaded
+    end
+
+    def self.merge_files(paths, &on_error)
+      merger = Merger.new
+      merger.result if merge_into(merger, paths, &on_error)
+    end
+
+    # Adds each dump to +merger+, passing the ones that fail to +on_error+.
+    # Returns whether any was added.
+    def self.merge_into(merger, paths, &on_error)
+      loaded = false
+      paths.each do |path|
+        begin
+          merger << load(path).data
+        rescue TypeError, ArgumentError => e
+          raise unless on_error
+          on_error.call(path, e)
+          next
+        end
+        loaded = true
+      end
+      loaded
+    end
+
     def initialize(data)
       @data = data
     end
     attr_reader :data
 
     def frames(sort_by_total=false)
-      @data[:frames].sort_by{ |iseq, stats| -stats[sort_by_total ? :total_samples : :samples] }.inject({}){|h, (k, v)| h[k] = v; h}
+      @frames ||= {}
+      @frames[sort_by_total] ||= sorted_frame_ids(sort_by_total).inject({}){ |h, id| h[id] = @data[:frames][id]; h }
     end
 
     def normalized_frames
@@ -41,6 +139,7 @@ module StackProf
     end
 
     def files
+      return @data[:files] ||= @data[:frames].file_lines if @data[:frames].respond_to?(:file_lines)
       @data[:files] ||= @data[:frames].inject(Hash.new) do |hash, (addr, frame)|
         if file = frame[:file] and lines = frame[:lines]
           hash[file] ||= Hash.new
@@ -54,8 +153,8 @@ module StackProf
 
     def add_lines(a, b)
       return b if a.nil?
-      return a+b if a.is_a? Fixnum
-      return [ a[0], a[1]+b ] if b.is_a? Fixnum
+      return a+b if a.is_a? Integer
+      return [ a[0], a[1]+b ] if b.is_a? Integer
       [ a[0]+b[0], a[1]+b[1] ]
     end
 
@@ -64,92 +163,133 @@ module StackProf
     end
 
     def print_dump(f=STDOUT)
-      f.puts Marshal.dump(@data.reject{|k,v| k == :files })
+      f.puts Marshal.dump(@data.to_h.reject{|k,v| k == :files })
     end
 
     def print_stackcollapse
-      raise "profile does not include raw samples (add `raw: true` to collecting StackProf.run)" unless raw = data[:raw]
-
-      curr_index = 0
-      while len = raw[curr_index]
-        curr_index += 1
-        frames = raw[curr_index, len]
-        weight = raw[curr_index + len + 1]
-        curr_index += len + 1
-
-        print frames.map{ |a| data[:frames][a][:name] }.join(';')
+      each_stackcollapse do |line, weight|
+        print line
         puts " #{weight}"
       end
     end
 
-    def print_flamegraph(f=STDOUT, skip_common=true)
-      raise "profile does not include raw samples (add `raw: true` to collecting StackProf.run)" unless raw = data[:raw]
-
-      stacks = []
-      max_x = 0
-      max_y = 0
-      curr_index = 0
-      while len = raw[curr_index]
-        curr_index += 1
-
-        max_y = len if len > max_y
-
-        stack = raw[curr_index, len+1]
-        curr_index += len+1
-        stacks << stack
-        max_x += stack.last
+    # Yields every raw sample as its stack of frame names joined with ';',
+    # reusing the same String, and its weight.
+    def each_stackcollapse
+      names = Hash.new{ |h, id| h[id] = data[:frames][id][:name] }
+      line = String.new
+      ends = [0] # length of +line+ up to each depth
+      each_raw_stack do |stack, shared, weight|
+        line.slice!(ends[shared]..-1)
+        (shared...stack.size).each do |y|
+          line << ';' if y > 0
+          line << names[stack[y]]
+          ends[y + 1] = line.size
+        end
+        yield line, weight
       end
+    end
 
+    # Rows are written as soon as they end, so only the row open at each
+    # depth is kept rather than every stack.
+    def print_flamegraph(f=STDOUT, skip_common=true)
+      rows = [] # [frame id, x it starts at] of the open row at each depth
+      x = 0
+      @rows_started = false
       f.puts 'flamegraph(['
-      max_y.times do |y|
-        row_prev = nil
-        row_width = 0
-        x = 0
-
-        stacks.each do |stack|
-          weight = stack.last
-          cell = stack[y] unless y == stack.length-1
-
-          if cell.nil?
-            if row_prev
-              flamegraph_row(f, x - row_width, y, row_width, row_prev)
-            end
-
-            row_prev = nil
-            x += weight
-            next
-          end
-
-          if row_prev.nil?        # start new row with this cell
-            row_width = weight
-            row_prev = cell
-            x += weight
+      each_raw_stack do |stack, shared, weight, timestamp|
+        # timestamped samples are placed where they were taken, so idle
+        # time shows up as gaps, which end every row
+        start = timestamp ? [timestamp / timeline_unit - weight, x].max : x
+        if start > x
+          flamegraph_end_rows(f, rows, x)
+          x, shared = start, 0
+        end
 
-          elsif row_prev == cell  # grow current row along x-axis
-            row_width += weight
-            x += weight
+        # rows above +shared+ carry on; deeper ones carry on if the frame
+        # at their depth is the same
+        (shared...[rows.size, stack.size].max).each do |y|
+          next if rows[y] && rows[y][0] == stack[y]
+          flamegraph_row(f, rows[y][1], y, x - rows[y][1], rows[y][0]) if rows[y]
+          rows[y] = [stack[y], x]
+        end
+        rows.slice!(stack.size..-1)
+        x += weight
+      end
+      # a row as wide as the graph is a frame every sample shares
+      flamegraph_end_rows(f, rows, x, skip_common ? 0 : nil)
+      f.puts '])'
+    end
 
-          else                    # end current row and start new row
-            flamegraph_row(f, x - row_width, y, row_width, row_prev)
-            x += weight
-            row_prev = cell
-            row_width = weight
-          end
+    def flamegraph_end_rows(f, rows, x, skip_start = nil)
+      rows.each_with_index do |(frame, start), y|
+        flamegraph_row(f, start, y, x - start, frame) unless start == skip_start
+      end
+      rows.clear
+    end
 
-          row_prev = cell
-        end
+    # Gzipped pprof protobuf, for `go tool pprof` and friends.
+    def print_pprof(f = STDOUT)
+      Pprof.new(self).write(f)
+    end
 
-        if row_prev
-          next if skip_common && row_width == max_x
+    # Chrome / Perfetto trace events (JSON), one slice per frame from the
+    # first sample it's on the stack in to the last, on a track per thread.
+    # Samples are placed by their timestamps when the profile has them, so
+    # slices end at idle gaps; otherwise one after another. Written as the
+    # samples are read, keeping only each thread's current stack.
+    def print_chrome_trace(f = STDOUT)
+      unit = timeline_unit
+      names = Hash.new{ |h, id| frame = data[:frames][id]; h[id] = [frame[:name].to_json, frame[:file].to_s.to_json] }
+      tracks = Hash.new{ |h, thread| h[thread] = [[], 0] } # thread => [stack, time it was last sampled]
+      clock = 0
+      started = false
+      event = lambda do |ph, id, time, thread|
+        f.print started ? ",\n" : "\n"
+        started = true
+        name, file = names[id]
+        f.print %{{"name":#{name},"cat":"stackprof","ph":"#{ph}","ts":#{time},"pid":1,"tid":#{thread},"args":{"file":#{file}}}}
+      end
+      close = lambda do |stack, depth, time, thread|
+        (stack.size - 1).downto(depth){ |y| event.call("E", stack[y], time, thread) }
+        stack.slice!(depth..-1)
+      end
 
-          flamegraph_row(f, x - row_width, y, row_width, row_prev)
+      f.print '{"traceEvents":['
+      (data[:threads] || {}).each do |index, thread|
+        next unless name = thread[:name]
+        f.print started ? ",\n" : "\n"
+        started = true
+        f.print %{{"name":"thread_name","ph":"M","pid":1,"tid":#{index},"args":{"name":#{name.to_json}}}}
+      end
+      each_raw_sample do |frames, weight, thread, timestamp|
+        thread ||= 0
+        track = tracks[thread]
+        stack, last = track
+        time = timestamp || (clock += weight * unit)
+        start = [time - weight * unit, last].max
+        close.call(stack, 0, last, thread) if start > last
+
+        shared = 0
+        shared += 1 while shared < stack.size && shared < frames.size && stack[shared] == frames[shared]
+        close.call(stack, shared, start, thread)
+        frames.drop(shared).each do |id|
+          event.call("B", id, start, thread)
+          stack << id
         end
+        track[1] = time
       end
-      f.puts '])'
+      tracks.each{ |thread, (stack, last)| close.call(stack, 0, last, thread) }
+      f.puts "\n]," + %{"displayTimeUnit":"ms","otherData":{"mode":"#{modeline}"}} + "}"
+    end
+
+    # usecs per flamegraph column: the sampling interval in the timer modes
+    def timeline_unit
+      [:wall, :cpu].include?(@data[:mode]) ? @data[:interval] : 1000
     end
 
     def flamegraph_row(f, x, y, weight, addr)
-      frame = frames[addr]
+      frame = @data[:frames][addr]
       f.print ',' if @rows_started
       @rows_started = true
       f.puts %{{"x":#{x},"y":#{y},"width":#{weight},"frame_id":#{addr},"frame":#{frame[:name].dump},"file":#{frame[:file].dump}}}
@@ -220,15 +360,18 @@ module StackProf
     def print_text(sort_by_total=false, limit=nil, select_files= nil, reject_files=nil, select_names=nil, reject_names=nil, f = STDOUT)
       f.puts "=================================="
       f.printf "  Mode: #{modeline}\n"
+      if history = @data[:interval_history]
+        f.printf "  Interval: %d-%d (changed %d times, samples weighted to #{@data[:interval]})\n", *history.map(&:last).minmax, history.size - 1
+      end
       f.printf "  Samples: #{@data[:samples]} (%.2f%% miss rate)\n", 100.0*@data[:missed_samples]/(@data[:missed_samples]+@data[:samples])
       f.printf "  GC: #{@data[:gc_samples]} (%.2f%%)\n", 100.0*@data[:gc_samples]/@data[:samples]
       f.puts "=================================="
       f.printf "% 10s    (pct)  % 10s    (pct)     FRAME\n" % ["TOTAL", "SAMPLES"]
-      list = frames(sort_by_total)
-      list.select!{|_, info| select_files.any?{|path| info[:file].start_with?(path)}} if select_files
-      list.select!{|_, info| select_names.any?{|reg| info[:name] =~ reg}} if select_names
-      list.reject!{|_, info| reject_files.any?{|path| info[:file].start_with?(path)}} if reject_files
-      list.reject!{|_, info| reject_names.any?{|reg| info[:name] =~ reg}} if reject_names
+      list = sorted_frame_ids(sort_by_total).lazy.map{ |id| [id, @data[:frames][id]] }
+      list = list.select{|_, info| select_files.any?{|path| info[:file].start_with?(path)}} if select_files
+      list = list.select{|_, info| select_names.any?{|reg| info[:name] =~ reg}} if select_names
+      list = list.reject{|_, info| reject_files.any?{|path| info[:file].start_with?(path)}} if reject_files
+      list = list.reject{|_, info| reject_names.any?{|reg| info[:name] =~ reg}} if reject_names
       list = list.first(limit) if limit
       list.each do |frame, info|
         call, total = info.values_at(:samples, :total_samples)
@@ -269,7 +412,10 @@ module StackProf
 
     def print_method(name, f = STDOUT)
       name = /#{name}/ unless Regexp === name
-      frames.each do |frame, info|
+      ids = sorted_frame_ids
+      ids &= @data[:frames].ids_matching_name(name) if @data[:frames].respond_to?(:ids_matching_name)
+      ids.each do |frame|
+        info = @data[:frames][frame]
         next unless info[:name] =~ name
         file, line = info.values_at(:file, :line)
         line ||= 1
@@ -279,6 +425,13 @@ module StackProf
         f.printf "%s (%s:%d)\n", info[:name], file, line
         f.printf "  samples: % 5d self (%2.1f%%)  /  % 5d total (%2.1f%%)\n", info[:samples], 100.0*info[:samples]/overall_samples, info[:total_samples], 100.0*info[:total_samples]/overall_samples
 
+        if states = info[:states]
+          f.puts "  states:"
+          states.sort_by{ |state, (total, _)| -total }.each do |state, (total, samples)|
+            f.printf "   % 5d self  /  % 5d total (%3.1f%%)  %s\n", samples, total, 100.0*total/info[:total_samples], state
+          end
+        end
+
         if (callers = callers_for(frame)).any?
           f.puts "  callers:"
           callers = callers.sort_by(&:last).reverse
@@ -301,7 +454,11 @@ module StackProf
     end
 
     def print_files(sort_by_total=false, limit=nil, f = STDOUT)
-      list = files.map{ |file, vals| [file, vals.values.inject([0,0]){ |sum, n| add_lines(sum, n) }] }
+      list = files.map do |file, vals|
+        sum = [0, 0]
+        vals.each_value{ |n| n.is_a?(Array) ? (sum[0] += n[0]; sum[1] += n[1]) : sum[1] += n }
+        [file, sum]
+      end
       list = list.sort_by{ |file, samples| -samples[1] }
       list = list.first(limit) if limit
       list.each do |file, vals|
@@ -321,57 +478,234 @@ module StackProf
     def +(other)
       raise ArgumentError, "cannot combine #{other.class}" unless self.class == other.class
       raise ArgumentError, "cannot combine #{modeline} with #{other.modeline}" unless modeline == other.modeline
-      raise ArgumentError, "cannot combine v#{version} with v#{other.version}" unless version == other.version
-
-      f1, f2 = normalized_frames, other.normalized_frames
-      frames = (f1.keys + f2.keys).uniq.inject(Hash.new) do |hash, id|
-        if f1[id].nil?
-          hash[id] = f2[id]
-        elsif f2[id]
-          hash[id] = f1[id]
-          hash[id][:total_samples] += f2[id][:total_samples]
-          hash[id][:samples] += f2[id][:samples]
-          if f2[id][:edges]
-            edges = hash[id][:edges] ||= {}
-            f2[id][:edges].each do |edge, weight|
-              edges[edge] ||= 0
-              edges[edge] += weight
-            end
-          end
-          if f2[id][:lines]
-            lines = hash[id][:lines] ||= {}
-            f2[id][:lines].each do |line, weight|
-              lines[line] = add_lines(lines[line], weight)
-            end
+
+      self.class.merge([self, other])
+    end
+
+    # Yields every raw sample as its stack of frame ids, outermost frame
+    # first, along with its weight and (for profiles taken with threads or
+    # per_thread) its index into #threads.
+    def each_raw_sample
+      if nodes = data[:raw_nodes]
+        samples = data[:raw_samples]
+        threads = data[:raw_sample_threads]
+        deltas = data[:raw_timestamp_deltas]
+        time = 0
+        i = 0
+        while i < samples.size
+          time += deltas[i/2] if deltas
+          yield raw_stack(samples[i]), samples[i+1], threads && threads[i/2], deltas && time
+          i += 2
+        end
+      elsif raw = data[:raw]
+        # flat [len, *frames, weight] layout of older dumps
+        curr_index = 0
+        while len = raw[curr_index]
+          curr_index += 1
+          yield raw[curr_index, len], raw[curr_index + len]
+          curr_index += len + 1
+        end
+      else
+        raise "profile does not include raw samples (add `raw: true` to collecting StackProf.run)"
+      end
+    end
+
+    # index => { thread_id:, name:, fiber_id:, native_thread_id:, samples: }
+    def threads
+      @data[:threads] || {}
+    end
+
+    def print_threads(f = STDOUT)
+      threads.sort_by{ |index, thread| -thread[:samples] }.each do |index, thread|
+        desc = []
+        desc << (thread[:name] || "thread #{thread[:thread_id]}") if thread[:thread_id]
+        desc << "fiber #{thread[:fiber_id]}" if thread[:fiber_id]
+        desc << "tid #{thread[:native_thread_id]}" if thread[:native_thread_id]
+        f.printf "% 5d  % 10d  (%5.1f%%)   %s\n", index, thread[:samples], 100.0*thread[:samples]/overall_samples, desc.join(', ')
+      end
+    end
+
+    # A report of just the samples taken on the given #threads indexes,
+    # rebuilt from the raw samples. Per-line counts are not part of raw
+    # samples, so the frames it has carry no :lines.
+    def thread_report(*indexes)
+      indexes = indexes.flatten
+      raise "profile does not include per-thread raw samples (add `threads: true, raw: true` to collecting StackProf.run)" unless data[:raw_sample_threads]
+
+      raw_report{ |i| indexes.include?(data[:raw_sample_threads][i]) }
+    end
+
+    # index => { name:, samples: } for every StackProf.with_tag tag samples
+    # were taken under
+    def tags
+      @data[:tags] || {}
+    end
+
+    def print_tags(f = STDOUT)
+      tags.sort_by{ |index, tag| -tag[:samples] }.each do |index, tag|
+        f.printf "% 5d  % 10d  (%5.1f%%)   %s\n", index, tag[:samples], 100.0*tag[:samples]/overall_samples, tag[:name]
+      end
+    end
+
+    # Like #thread_report, for the samples tagged with any of the given
+    # tags (or #tags indexes). Tags also match by their string form, so the
+    # names `stackprof --tag` passes find Symbol tags too.
+    def tag_report(*names)
+      names = names.flatten
+      raise "profile does not include tagged raw samples (tag them with StackProf.with_tag, and add `raw: true` to collecting StackProf.run)" unless data[:raw_sample_tags]
+
+      indexes = tags.select{ |index, tag| names.include?(tag[:name]) || names.include?(tag[:name].to_s) || names.include?(index) }.keys
+      raw_report{ |i| indexes.include?(data[:raw_sample_tags][i]) }
+    end
+
+    # Walks the raw samples like #each_raw_sample, but through the stack
+    # trie, so each sample only costs the frames that changed since the one
+    # before. Yields the same Array every time, holding the current stack,
+    # with the depth up to which it's unchanged, the weight and the
+    # timestamp. Memory is bounded by the deepest stack, not the samples.
+    def each_raw_stack
+      stack = []
+      unless nodes = data[:raw_nodes]
+        return each_raw_sample do |frames, weight|
+          shared = 0
+          shared += 1 while shared < frames.size && stack[shared] == frames[shared]
+          stack.replace(frames)
+          yield stack, shared, weight, nil
+        end
+      end
+
+      samples = data[:raw_samples]
+      deltas = data[:raw_timestamp_deltas]
+      path = [] # node of each stack entry
+      depths = { 0 => 0 } # node => its depth, for the nodes on path
+      suffix = []
+      time = 0
+      i = 0
+      while i < samples.size
+        node = samples[i]
+        suffix.clear
+        until shared = depths[node]
+          suffix << node
+          node = nodes[2*node - 2]
+        end
+        path.slice!(shared..-1).each{ |n| depths.delete(n) }
+        stack.slice!(shared..-1)
+        suffix.reverse_each do |n|
+          path << n
+          depths[n] = path.size
+          stack << nodes[2*n - 1]
+        end
+        time += deltas[i/2] if deltas
+        yield stack, shared, samples[i+1], deltas && time
+        i += 2
+      end
+    end
+
+    # usecs since :raw_start_timestamp at which each raw sample was taken,
+    # when the profile was collected with timestamps: true
+    def raw_timestamps
+      return unless deltas = data[:raw_timestamp_deltas]
+      @raw_timestamps ||= begin
+        time = 0
+        deltas.map{ |delta| time += delta }
+      end
+    end
+
+    # Walks the stack trie from +node+ up to the root, and returns the
+    # frames outermost first.
+    def raw_stack(node)
+      nodes = data[:raw_nodes]
+      stack = []
+      while node > 0
+        stack << nodes[2*node - 1]
+        node = nodes[2*node - 2]
+      end
+      stack.reverse!
+    end
+
+    private
+
+    # Rebuilds a profile from the raw samples whose index the block keeps.
+    # The thread and tag tables are narrowed to, and recounted over, those.
+    def raw_report
+      frames = {}
+      raw_samples = []
+      per_sample = { raw_sample_threads: [:threads, []], raw_sample_tags: [:tags, []] }.select{ |key, _| data[key] }
+      tables = per_sample.map{ |key, (table, _)| [table, {}] }.to_h
+      timestamps = raw_timestamps && []
+      samples = 0
+      data[:raw_samples].each_slice(2).with_index do |(node, weight), i|
+        next unless yield i
+        raw_samples << node << weight
+        timestamps << raw_timestamps[i] if timestamps
+        samples += weight
+        per_sample.each do |key, (table, kept)|
+          kept << index = data[key][i]
+          next if index == 0
+          entry = tables[table][index] ||= data[table][index].merge(samples: 0)
+          entry[:samples] += weight
+        end
+
+        stack = raw_stack(node)
+        stack.each_with_index do |addr, depth|
+          frame = frames[addr] ||= data[:frames][addr].reject{ |k, _| k == :edges || k == :lines }.merge(samples: 0, total_samples: 0)
+          frame[:total_samples] += weight
+          if callee = stack[depth + 1]
+            edges = frame[:edges] ||= {}
+            edges[callee] = (edges[callee] || 0) + weight
+          else
+            frame[:samples] += weight
           end
-        else
-          hash[id] = f1[id]
         end
-        hash
       end
 
-      d1, d2 = data, other.data
-      data = {
+      profile = {
         version: version,
-        mode: d1[:mode],
-        interval: d1[:interval],
-        samples: d1[:samples] + d2[:samples],
-        gc_samples: d1[:gc_samples] + d2[:gc_samples],
-        missed_samples: d1[:missed_samples] + d2[:missed_samples],
-        frames: frames
+        mode: data[:mode],
+        interval: data[:interval],
+        samples: samples,
+        gc_samples: 0,
+        missed_samples: 0,
+        frames: frames,
+        raw_nodes: data[:raw_nodes],
+        raw_samples: raw_samples
       }
-
-      self.class.new(data)
+      profile.update(tables)
+      per_sample.each{ |key, (_, kept)| profile[key] = kept }
+      if timestamps
+        profile[:raw_start_timestamp] = data[:raw_start_timestamp]
+        profile[:raw_start_time] = data[:raw_start_time]
+        profile[:raw_timestamp_deltas] = timestamps.each_with_index.map{ |time, i| i == 0 ? time : time - timestamps[i - 1] }
+      end
+      self.class.new(profile)
     end
 
-    private
     def root_frames
       frames.select{ |addr, frame| callers_for(addr).size == 0  }
     end
 
     def callers_for(addr)
-      @callers_for ||= {}
-      @callers_for[addr] ||= data[:frames].map{ |id, other| [other[:name], other[:edges][addr]] if other[:edges] && other[:edges].include?(addr) }.compact
+      callers[addr].map{ |id, weight| [data[:frames][id][:name], weight] }
+    end
+
+    # callee => [[caller, weight], ...] for every edge, built in one pass
+    def callers
+      return @callers ||= data[:frames].callers if data[:frames].respond_to?(:callers)
+      @callers ||= data[:frames].each_with_object(Hash.new{ |h, k| h[k] = [] }) do |(id, frame), callers|
+        frame[:edges].each{ |callee, weight| callers[callee] << [id, weight] } if frame[:edges]
+      end
+    end
+
+    # Ties keep the dump's frame order, so a report reads the same however
+    # the dump was loaded.
+    def sorted_frame_ids(sort_by_total=false)
+      key = sort_by_total ? :total_samples : :samples
+      frames = @data[:frames]
+      if frames.respond_to?(:sorted_ids)
+        frames.sorted_ids(sort_by_total)
+      else
+        frames.each_with_index.sort_by{ |(id, info), i| [-info[key], i] }.map{ |(id, _), _| id }
+      end
     end
 
     def source_display(f, file, lines, range=nil)
@@ -0,0 +1,78 @@
+require 'fileutils'
+
+module StackProf
+  # Writes results to disk from a background thread, so the caller only
+  # pays for handing them off. At most +max_pending+ results wait to be
+  # written; anything past that is dropped (and counted) rather than
+  # making the caller wait on the disk.
+  class Writer
+    attr_reader :dropped, :written
+
+    def initialize(max_pending: 2)
+      @queue = SizedQueue.new(max_pending)
+      @lock = Mutex.new # starting and stopping the thread
+      @counts = Mutex.new # dropped and written
+      @dropped = 0
+      @written = 0
+      @thread = nil
+      @pid = nil
+    end
+
+    # Queues +results+ to be marshalled into +path+. Returns false if they
+    # were dropped because the queue was full.
+    def write(path, results)
+      start
+      @queue.push([path, results], true)
+      true
+    rescue ThreadError
+      @counts.synchronize{ @dropped += 1 }
+      false
+    end
+
+    # Waits for everything queued so far to be written, and stops the thread.
+    def close
+      @lock.synchronize do
+        return unless running?
+        @queue.push(nil)
+        @thread.join
+        @thread = nil
+      end
+    end
+
+    def pending
+      @queue.size
+    end
+
+    private
+
+    # the thread doesn't survive a fork, so the child starts its own
+    def running?
+      @thread && @pid == Process.pid
+    end
+
+    # under the lock, so threads writing at once don't each start a thread;
+    # the writer thread never takes it, so close can join while holding it
+    def start
+      @lock.synchronize do
+        return if running?
+        @queue.clear if @pid && @pid != Process.pid
+        @pid = Process.pid
+        @thread = Thread.new{ run }
+        @thread.name = 'stackprof-writer' if @thread.respond_to?(:name=)
+      end
+    end
+
+    def run
+      while job = @queue.pop
+        path, results = job
+        begin
+          FileUtils.mkdir_p(File.dirname(path))
+          File.open(path, 'wb'){ |f| f.write Marshal.dump(results) }
+          @counts.synchronize{ @written += 1 }
+        rescue => e
+          warn "stackprof: failed to write #{path}: #{e.message}"
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,66 @@
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'stackprof'
+require 'minitest/autorun'
+require 'stringio'
+
+class StackProf::DiffTest < MiniTest::Test
+  def profile(samples, fast, slow)
+    {
+      version: 1.2, mode: :cpu, interval: 1000, samples: samples, gc_samples: 0, missed_samples: 0,
+      frames: {
+        1 => { name: 'main', file: 'app.rb', line: 1, total_samples: samples, samples: 0, edges: { 2 => fast, 3 => slow } },
+        2 => { name: 'fast', file: 'app.rb', line: 5, total_samples: fast, samples: fast },
+        3 => { name: 'slow', file: 'app.rb', line: 9, total_samples: slow, samples: slow },
+      },
+      raw_nodes: [0, 1, 1, 2, 1, 3],
+      raw_samples: [2, fast, 3, slow],
+    }
+  end
+
+  def test_frames
+    diff = StackProf::Diff.new(profile(100, 50, 50), profile(200, 60, 140))
+    slow, fast, main = %w[slow fast main].map{ |name| diff.frames.find{ |f| f[:name] == name } }
+
+    assert_in_delta 50.0, slow[:base_samples]
+    assert_in_delta 70.0, slow[:samples]
+    assert_in_delta 20.0, slow[:samples_delta]
+    assert_in_delta(-20.0, fast[:samples_delta])
+    assert_operator slow[:z], :>, 3
+    assert_operator fast[:z], :<, -3
+    assert_in_delta 0.0, main[:total_delta]
+
+    assert_equal %w[fast slow], diff.significant_frames.map{ |f| f[:name] }.sort
+    assert_equal %w[fast slow], diff.significant_frames(true).map{ |f| f[:name] }.sort
+    assert_empty StackProf::Diff.new(profile(100, 50, 50), profile(200, 60, 140), threshold: 100).significant_frames
+  end
+
+  def test_noise_is_not_significant
+    diff = StackProf::Diff.new(profile(100, 50, 50), profile(100, 52, 48))
+    assert_empty diff.significant_frames
+  end
+
+  def test_print_text
+    out = StringIO.new
+    StackProf::Diff.new(profile(100, 50, 50), profile(200, 60, 140)).print_text(false, nil, out)
+    assert_includes out.string, "Changed: 2 of 3 frames"
+    assert_match(/\+20\.0%\s+\(50\.0%\)\s+\+20\.0%\s+\(50\.0%\)\s+slow/, out.string)
+  end
+
+  def test_print_stackcollapse
+    out = StringIO.new
+    StackProf::Diff.new(profile(100, 50, 50), profile(200, 60, 140)).print_stackcollapse(out)
+    assert_equal ["main;fast 100 60", "main;slow 100 140"], out.string.lines.map(&:chomp).sort
+  end
+
+  def test_print_graphviz
+    out = StringIO.new
+    StackProf::Diff.new(profile(100, 50, 50), profile(200, 60, 140)).print_graphviz({}, out)
+    assert_match(/label="slow\\n50\.0% -> 70\.0% of samples/, out.string)
+    assert_match(/color=red/, out.string)
+    assert_match(/color=blue/, out.string)
+  end
+
+  def test_requires_same_mode
+    assert_raises(ArgumentError){ StackProf::Diff.new(profile(1, 1, 0), profile(1, 1, 0).merge(mode: :wall)) }
+  end
+end
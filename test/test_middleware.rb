@@ -64,4 +64,15 @@ class StackProf::MiddlewareTest < MiniTest::Test
     StackProf::Middleware.new(Object.new, raw: true)
     assert StackProf::Middleware.raw
   end
+
+  def test_save_continuous
+    StackProf::Middleware.new(Object.new, continuous: true)
+
+    StackProf.expects(:snapshot).returns({ mode: 'foo' })
+    StackProf.expects(:results).never
+    FileUtils.expects(:mkdir_p).with('tmp')
+    File.expects(:open).with(regexp_matches(/^tmp\/stackprof-foo/), 'wb')
+
+    StackProf::Middleware.save
+  end
 end
@@ -0,0 +1,60 @@
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'stackprof'
+require 'minitest/autorun'
+require 'stringio'
+require 'zlib'
+
+class StackProf::PprofTest < MiniTest::Test
+  # just enough protobuf to read the fields back: field => [values]
+  def decode(buffer)
+    fields = Hash.new{ |h, k| h[k] = [] }
+    io = StringIO.new(buffer)
+    until io.eof?
+      key = varint(io)
+      fields[key >> 3] << (key & 7 == 2 ? io.read(varint(io)) : varint(io))
+    end
+    fields
+  end
+
+  def varint(io)
+    n, shift = 0, 0
+    begin
+      byte = io.readbyte
+      n |= (byte & 0x7f) << shift
+      shift += 7
+    end while byte >= 0x80
+    n
+  end
+
+  def packed(buffer)
+    io = StringIO.new(buffer)
+    list = []
+    list << varint(io) until io.eof?
+    list
+  end
+
+  def test_print_pprof
+    profile = {
+      version: 1.2, mode: :cpu, interval: 1000, samples: 6, gc_samples: 0, missed_samples: 0,
+      frames: {
+        10 => { name: 'main', file: 'app.rb', line: 1, total_samples: 6, samples: 0 },
+        20 => { name: 'work', file: 'app.rb', line: 5, total_samples: 6, samples: 6 },
+      },
+      raw_nodes: [0, 10, 1, 20],
+      raw_samples: [2, 2, 1, 0, 2, 4],
+    }
+    out = StringIO.new
+    StackProf::Report.new(profile).print_pprof(out)
+    message = decode(Zlib.gunzip(out.string))
+
+    strings = message[6]
+    assert_equal "", strings[0]
+    assert_equal [["samples", "count"], ["cpu", "nanoseconds"]], message[1].map{ |t| decode(t).values_at(1, 2).map{ |v| strings[v[0]] } }
+    assert_equal 1000_000, message[12][0]
+
+    functions = message[5].map{ |f| decode(f) }.to_h{ |f| [f[1][0], strings[f[2][0]]] }
+    samples = message[2].map{ |s| decode(s) }
+    stacks = samples.map{ |s| [packed(s[1][0]).map{ |id| functions[id] }, packed(s[2][0])] }
+    assert_equal [[%w[work main], [6, 6_000_000]], [%w[main], [0, 0]]], stacks
+  end
+end
@@ -32,3 +32,35 @@ class ReportDumpTest < MiniTest::Test
     assert_equal expected, Marshal.load(marshal_data)
   end
 end
+
+class ReportChromeTraceTest < MiniTest::Test
+  require 'stringio'
+  require 'json'
+
+  def test_print_chrome_trace
+    profile = {
+      version: 1.2, mode: :wall, interval: 1000, samples: 4, gc_samples: 0, missed_samples: 0,
+      threads: { 1 => { name: 'main' }, 2 => { name: 'worker' } },
+      frames: {
+        10 => { name: 'main', file: 'app.rb', total_samples: 4, samples: 0 },
+        20 => { name: 'work', file: 'app.rb', total_samples: 3, samples: 3 },
+        30 => { name: 'wait', file: 'app.rb', total_samples: 1, samples: 1 },
+      },
+      raw_nodes: [0, 10, 1, 20, 1, 30],
+      raw_samples: [2, 1, 2, 1, 3, 1, 2, 1],
+      raw_sample_threads: [1, 1, 1, 2],
+      raw_timestamp_deltas: [1000, 1000, 1000, 5000],
+    }
+    out = StringIO.new
+    StackProf::Report.new(profile).print_chrome_trace(out)
+    events = JSON.parse(out.string)["traceEvents"]
+
+    assert_equal [[1, 'main'], [2, 'worker']], events.select{ |e| e["ph"] == "M" }.map{ |e| [e["tid"], e["args"]["name"]] }
+    slices = events.reject{ |e| e["ph"] == "M" }.map{ |e| [e["tid"], e["ph"], e["name"], e["ts"]] }
+    assert_equal [
+      [1, "B", "main", 0], [1, "B", "work", 0], [1, "E", "work", 2000], [1, "B", "wait", 2000],
+      [2, "B", "main", 7000], [2, "B", "work", 7000],
+      [1, "E", "wait", 3000], [1, "E", "main", 3000], [2, "E", "work", 8000], [2, "E", "main", 8000],
+    ], slices
+  end
+end
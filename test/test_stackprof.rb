@@ -2,11 +2,14 @@ $:.unshift File.expand_path('../../lib', __FILE__)
 require 'stackprof'
 require 'minitest/autorun'
 require 'tempfile'
+require 'tmpdir'
+require 'stringio'
+require 'json'
 
 class StackProfTest < MiniTest::Test
   def test_info
     profile = StackProf.run{}
-    assert_equal 1.1, profile[:version]
+    assert_equal 1.2, profile[:version]
     assert_equal :wall, profile[:mode]
     assert_equal 1000, profile[:interval]
     assert_equal 0, profile[:samples]
@@ -58,6 +61,46 @@ class StackProfTest < MiniTest::Test
     assert_equal 10, profile[:samples]
   end
 
+  def test_object_allocation_random
+    profile = StackProf.run(mode: :object, interval: 2, random: true) do
+      # a fixed stride of 2 would only ever sample one of these
+      5_000.times{ allocate_a; allocate_b }
+    end
+
+    assert_in_delta 5_000, profile[:samples], 500
+    assert_in_delta 10_000, profile[:samples] + profile[:missed_samples], 100
+    a, b = %w[allocate_a allocate_b].map{ |name| profile[:frames].values.find{ |f| f[:name] == "StackProfTest##{name}" } }
+    assert_in_delta a[:total_samples], b[:total_samples], 500
+
+    assert_raises(ArgumentError){ StackProf.start(mode: :wall, random: true) }
+  end
+
+  def test_object_allocation_bytes
+    profile = StackProf.run(mode: :object) do
+      10.times{ 'x' * 10_000 }
+    end
+
+    frame = profile[:frames].values.find{ |f| f[:name] == 'String#*' }
+    assert_operator frame[:bytes], :>=, 100_000
+    assert_equal frame[:bytes], frame[:total_bytes]
+    root = profile[:frames].values.max_by{ |f| f[:total_bytes] }
+    assert_operator root[:total_bytes], :>=, frame[:total_bytes]
+  end
+
+  def test_heap
+    StackProf.start(mode: :heap)
+    retained = Array.new(100){ Object.new }
+    StackProf.stop
+    profile = StackProf.results
+
+    assert_equal :heap, profile[:mode]
+    assert_operator profile[:samples], :>=, 100
+    frame = profile[:frames].values.select{ |f| f[:name] =~ /StackProfTest#test_heap/ }.max_by{ |f| f[:total_samples] }
+    assert_operator frame[:total_samples], :>=, 100
+    assert_operator frame[:total_bytes], :>=, 100 * 40
+    assert_equal 100, retained.size
+  end
+
   def test_cputime
     profile = StackProf.run(mode: :cpu, interval: 500) do
       math
@@ -68,6 +111,166 @@ class StackProfTest < MiniTest::Test
     assert_equal "block in StackProfTest#math", frame[:name]
   end
 
+  def test_buffered
+    profile = StackProf.run(mode: :cpu, interval: 500, buffered: true) do
+      spin(0.1)
+    end
+
+    assert_operator profile[:samples], :>, 10
+    assert_operator profile[:missed_samples], :<, profile[:samples]
+    assert profile[:frames].values.any?{ |f| f[:name] == "StackProfTest#spin" }
+  end
+
+  def test_per_thread
+    threads = nil
+    profile = StackProf.run(mode: :cpu, interval: 500, per_thread: true, raw: true) do
+      threads = 2.times.map{ Thread.new{ spin(0.1) } }
+      threads.each(&:join)
+    end
+
+    assert_operator profile[:samples], :>, 10
+    assert profile[:frames].values.any?{ |f| f[:name] == "StackProfTest#spin" }
+    tids = profile[:raw_sample_threads]
+    assert_equal profile[:raw_samples].size / 2, tids.size
+    assert_operator tids.uniq.size, :>=, 2
+    refute_includes tids, 0
+  end
+
+  def test_threads
+    worker = nil
+    profile = StackProf.run(mode: :custom, threads: true, raw: true) do
+      2.times{ StackProf.sample }
+      worker = Thread.new{ 3.times{ StackProf.sample } }
+      worker.name = 'worker'
+      worker.join
+      Fiber.new{ StackProf.sample }.resume
+    end
+
+    threads = profile[:threads]
+    assert_equal 3, threads.size
+    assert_equal [2, 3, 1], threads.values.map{ |t| t[:samples] }
+    assert_equal 'worker', threads[2][:name]
+    assert_equal threads[1][:thread_id], threads[3][:thread_id]
+    refute_equal threads[1][:fiber_id], threads[3][:fiber_id]
+    assert_equal [1, 2, 3], profile[:raw_sample_threads].uniq
+
+    report = StackProf::Report.new(profile).thread_report(2)
+    assert_equal 3, report.overall_samples
+    assert_equal ['worker'], report.threads.values.map{ |t| t[:name] }
+    assert_equal 3, report.frames.values.map{ |f| f[:samples] }.inject(:+)
+  end
+
+  def test_with_tag
+    value = nil
+    profile = StackProf.run(mode: :custom, raw: true) do
+      StackProf.sample
+      value = StackProf.with_tag("a") do |tag|
+        2.times{ StackProf.sample }
+        StackProf.with_tag(:b){ 3.times{ StackProf.sample } }
+        StackProf.sample
+        tag
+      end
+      StackProf.sample
+    end
+
+    assert_equal "a", value
+    assert_equal({ "a" => 3, :b => 3 }, profile[:tags].values.map{ |t| [t[:name], t[:samples]] }.to_h)
+    a, b = profile[:tags].keys
+    weights = profile[:raw_samples].each_slice(2).map(&:last)
+    assert_equal [0, a, a, b, b, b, a, 0], profile[:raw_sample_tags].zip(weights).flat_map{ |tag, weight| [tag] * weight }
+
+    report = StackProf::Report.new(profile).tag_report("a")
+    assert_equal 3, report.overall_samples
+    assert_equal ["a"], report.tags.values.map{ |t| t[:name] }
+    assert_equal 3, StackProf::Report.new(profile).tag_report("b").overall_samples
+
+    merged = StackProf.merge(profile, profile)
+    assert_equal({ "a" => 6, :b => 6 }, merged[:tags].values.map{ |t| [t[:name], t[:samples]] }.to_h)
+  end
+
+  def test_states
+    profile = StackProf.run(mode: :wall, states: true) do
+      spin(0.05)
+      sleep 0.05
+    end
+
+    states = profile[:states]
+    assert_operator states[:running], :>, 5
+    assert_operator states[:blocked], :>, 5
+    sleep_frame = profile[:frames].values.find{ |f| f[:name] == 'Kernel#sleep' }
+    assert_operator sleep_frame[:states][:blocked][1], :>, 5
+    # it can be caught just before it releases the GVL, but not for long
+    assert_operator sleep_frame[:states].fetch(:running, [0])[0], :<=, 1
+    spin_frame = profile[:frames].values.find{ |f| f[:name] == 'StackProfTest#spin' }
+    assert_equal spin_frame[:total_samples], spin_frame[:states][:running][0]
+  end
+
+  def test_per_thread_requires_cpu_mode
+    assert_raises(ArgumentError){ StackProf.start(mode: :wall, per_thread: true) }
+    refute StackProf.running?
+  end
+
+  def test_overhead
+    profile = StackProf.run(mode: :wall, interval: 100, overhead: 0.0001, raw: true) do
+      spin(0.1)
+    end
+
+    history = profile[:interval_history]
+    assert_equal [0, 100], history.first
+    assert_operator history.size, :>=, 2
+    history.drop(1).each do |samples, interval|
+      assert_equal 0, interval % 100
+      assert_operator interval, :>, 100
+    end
+    assert_equal profile[:samples], profile[:raw_samples].each_slice(2).map(&:last).inject(0, :+) + profile[:gc_samples]
+  end
+
+  def test_overhead_requires_timer_mode
+    assert_raises(ArgumentError){ StackProf.start(mode: :custom, overhead: 0.01) }
+    assert_raises(ArgumentError){ StackProf.start(mode: :cpu, overhead: 2) }
+    refute StackProf.running?
+  end
+
+  def test_stats
+    StackProf.start(mode: :cpu, interval: 500, raw: true)
+    spin(0.05)
+    stats = StackProf.stats
+    StackProf.stop
+    StackProf.results
+
+    assert_equal true, stats[:running]
+    assert_equal :cpu, stats[:mode]
+    assert_operator stats[:samples], :>, 0
+    assert_equal stats[:signals] - stats[:samples], stats[:missed_samples]
+    assert_operator stats[:jobs], :>, 0
+    assert_operator stats[:job_time_ns], :>, 0
+    assert_operator stats[:frames], :>, 0
+    assert_in_delta stats[:frames].fdiv(stats[:frames_capa]), stats[:frames_load], 1e-9
+    assert_operator stats[:raw_bytes], :>, 0
+    assert_equal 0, stats[:heap_live]
+
+    stats = StackProf.stats
+    assert_equal false, stats[:running]
+    assert_equal 0, stats[:frames]
+  end
+
+  def test_symbolize
+    StackProf.start(mode: :custom, symbolize: true)
+    5.times{ StackProf.sample }
+    stats = StackProf.stats
+    snapshot = StackProf.snapshot
+    StackProf.stop
+    StackProf.results
+
+    assert_equal 0, stats[:symbols_pending]
+    assert_equal stats[:frames], stats[:symbols]
+    shared = snapshot[:frames].values.group_by{ |frame| frame[:file] }.values.select{ |frames| frames.size > 1 }
+    refute_empty shared
+    shared.each{ |frames| assert_equal 1, frames.map{ |frame| frame[:file].object_id }.uniq.size }
+    assert snapshot[:frames].values.all?{ |frame| frame[:name].frozen? }
+    assert_equal 0, StackProf.stats[:symbols]
+  end
+
   def test_walltime
     profile = StackProf.run(mode: :wall) do
       idle
@@ -102,10 +305,245 @@ class StackProfTest < MiniTest::Test
       end
     end
 
-    raw = profile[:raw]
-    assert_equal 10, raw[-1]
-    assert_equal raw[0] + 2, raw.size
-    assert_equal 'block (2 levels) in StackProfTest#test_raw', profile[:frames][raw[-2]][:name]
+    nodes, samples = profile.values_at(:raw_nodes, :raw_samples)
+    assert_equal 2, samples.size
+    assert_equal 10, samples[1]
+    assert_equal 'block (2 levels) in StackProfTest#test_raw', profile[:frames][nodes[2*samples[0] - 1]][:name]
+  end
+
+  def test_raw_stack_trie
+    profile = StackProf.run(mode: :custom, raw: true) do
+      2.times do
+        StackProf.sample
+        [1].each{ StackProf.sample }
+      end
+    end
+
+    nodes, samples = profile.values_at(:raw_nodes, :raw_samples)
+    assert_equal 8, samples.size
+    assert_equal samples[0], samples[4]
+    assert_equal samples[2], samples[6]
+
+    stacks = []
+    StackProf::Report.new(profile).each_raw_sample{ |frames, weight| stacks << frames }
+    assert_equal 4, stacks.size
+    assert_equal stacks[0][0..-2], stacks[1][0, stacks[0].size - 1]
+    assert_equal stacks[1].size + 1, nodes.size / 2
+  end
+
+  def test_shared_stack_prefix
+    StackProf.start(mode: :custom)
+    3.times{ StackProf.sample; [1].each{ StackProf.sample } }
+    # the last stack is still cached when the snapshot is taken
+    first = StackProf.snapshot
+    StackProf.sample
+    StackProf.stop
+    last = StackProf.results
+
+    sample = first[:frames].values.find{ |f| f[:name] == 'StackProf.sample' }
+    assert_equal [6, 6], sample.values_at(:total_samples, :samples)
+    assert_equal 6, first[:frames].values.find{ |f| f[:name] == 'Integer#times' }[:total_samples]
+    first[:frames].each_value do |frame|
+      assert_equal frame[:total_samples], frame[:samples] + (frame[:edges] || {}).values.sum
+    end
+    assert_equal 1, last[:frames].values.find{ |f| f[:name] == 'StackProf.sample' }[:total_samples]
+    assert_nil last[:frames].values.find{ |f| f[:name] == 'Integer#times' }
+  end
+
+  def test_merge
+    profiles = 2.times.map do
+      StackProf.run(mode: :custom, raw: true, threads: true) do
+        5.times{ StackProf.sample }
+      end
+    end
+
+    merged = StackProf.merge(*profiles)
+    assert_equal 10, merged[:samples]
+    assert_equal profiles[0][:frames].size, merged[:frames].size
+
+    assert_equal 10, merged[:frames].values.map{ |f| f[:samples] }.inject(:+)
+    profiles[0][:frames].each_value do |frame|
+      key = frame.values_at(:name, :file, :line)
+      merged_frame = merged[:frames].values.find{ |f| f.values_at(:name, :file, :line) == key }
+      assert_equal 2 * frame[:total_samples], merged_frame[:total_samples]
+      assert_equal frame[:lines].transform_values{ |t, s| [2*t, 2*s] }, merged_frame[:lines] if frame[:lines]
+    end
+
+    stacks = []
+    StackProf::Report.new(merged).each_raw_sample{ |frames, weight, thread| stacks << [frames, weight, thread] }
+    assert_equal 2, stacks.size
+    assert_equal stacks[0][0], stacks[1][0]
+    assert_equal [5, 5], stacks.map{ |_, weight| weight }
+    assert_equal [1, 2], stacks.map(&:last)
+    assert_equal 2, merged[:threads].size
+
+    report = StackProf::Report.new(profiles[0]) + StackProf::Report.new(profiles[1])
+    assert_equal merged, report.data
+  end
+
+  def test_load_merged_in_parallel
+    Dir.mktmpdir do |dir|
+      paths = 5.times.map do |i|
+        path = File.join(dir, "#{i}.dump")
+        StackProf.run(mode: :custom, raw: true, out: path, format: i.even? ? :binary : :marshal) do
+          (i + 1).times{ StackProf.sample }
+          [i].each{ StackProf.sample }
+        end
+        path
+      end
+      paths << File.join(dir, "broken.dump")
+      File.write(paths.last, "\x04\x09")
+
+      errors, parallel_errors = [], []
+      sequential = StackProf::Report.load_merged(paths){ |path, _| errors << path }
+      parallel = StackProf::Report.load_merged(paths, jobs: 3){ |path, e| parallel_errors << [path, e.class] }
+
+      assert_equal [paths.last], errors
+      assert_equal [[paths.last, TypeError]], parallel_errors
+      assert_raises(TypeError){ StackProf::Report.load_merged(paths, jobs: 3) }
+      assert_equal 20, sequential[:samples]
+      assert_equal sequential, parallel
+      assert_equal Marshal.dump(sequential), Marshal.dump(parallel)
+    end
+  end
+
+  def test_load_merged_skips_unmergeable
+    Dir.mktmpdir do |dir|
+      dump = ->(name, mode, format){
+        path = File.join(dir, name)
+        StackProf.run(mode: mode, raw: true, out: path, format: format){ StackProf.sample if mode == :custom }
+        path
+      }
+      # with 3 jobs the slices are [0, truncated], [wall, 1] and [2]
+      paths = [dump["0.dump", :custom, :binary], dump["wall.dump", :wall, :marshal],
+               dump["1.dump", :custom, :marshal], dump["2.dump", :custom, :binary]]
+      truncated = File.join(dir, "truncated.dump")
+      File.binwrite(truncated, File.binread(paths[0])[0, 40])
+      paths.insert(1, truncated)
+
+      errors = Hash.new{ |h, k| h[k] = [] }
+      merged = [1, 3].map do |jobs|
+        StackProf::Report.load_merged(paths, jobs: jobs){ |path, e| errors[jobs] << [File.basename(path), e.class] }
+      end
+
+      assert_equal [["truncated.dump", StackProf::BinaryDump::FormatError], ["wall.dump", ArgumentError]], errors[1]
+      assert_equal errors[1], errors[3]
+      assert_equal 3, merged[0][:samples]
+      assert_equal merged[0], merged[1]
+      assert_raises(ArgumentError){ StackProf::Report.load_merged(paths) }
+    end
+  end
+
+  def test_frame_ids_are_stable
+    define = -> { eval("def stable_frame; StackProf.sample; end", nil, "stable.rb", 1) }
+    ids = 2.times.map do
+      define.call
+      profile = StackProf.run(mode: :custom){ stable_frame }
+      profile[:frames].find{ |_, f| f[:name] =~ /stable_frame/ }.first
+    end
+    assert_equal ids[0], ids[1]
+
+    profile = StackProf.run(mode: :custom) do
+      define.call; stable_frame
+      define.call; stable_frame
+    end
+    frames = profile[:frames].select{ |_, f| f[:name] =~ /stable_frame/ }
+    assert_equal [ids[0]], frames.keys
+    assert_equal 2, frames[ids[0]][:total_samples]
+  end
+
+  def test_merge_requires_same_mode
+    profile = StackProf.run(mode: :custom){ StackProf.sample }
+    assert_raises(ArgumentError){ StackProf.merge(profile, profile.merge(mode: :object)) }
+  end
+
+  def test_merge_translates_older_versions
+    profile = StackProf.run(mode: :custom, raw: true){ 3.times{ StackProf.sample } }
+
+    # v1.1 wrote object ids for frames and a flat [len, *frames, weight] :raw
+    ids = profile[:frames].keys.each_with_index.map{ |id, i| [id, 1000 + i] }.to_h
+    raw = []
+    StackProf::Report.new(profile).each_raw_sample{ |frames, weight| raw.push(frames.size, *frames.map(&ids), weight) }
+    old = profile.reject{ |key, _| [:raw_nodes, :raw_samples, :raw_timestamp_deltas].include?(key) }
+    old = old.merge(version: 1.1, raw: raw, frames: profile[:frames].map{ |id, frame|
+      [ids[id], frame.merge(edges: frame[:edges]&.transform_keys(&ids))]
+    }.to_h)
+
+    merged = StackProf.merge(profile, old)
+    assert_equal 1.2, merged[:version]
+    assert_equal profile[:frames].size, merged[:frames].size
+    assert_equal merged, StackProf.merge(profile, profile)
+
+    assert_raises(ArgumentError){ StackProf.merge(profile, profile.merge(version: 1.3)) }
+  end
+
+  def test_merger_rejects_malformed_profile_whole
+    profile = StackProf.run(mode: :custom, raw: true){ 3.times{ StackProf.sample } }
+    broken = profile.merge(raw_samples: profile[:raw_samples] + [profile[:raw_nodes].size, 1])
+
+    merger = StackProf::Merger.new
+    merger << profile
+    assert_raises(ArgumentError){ merger << broken }
+    assert_raises(TypeError){ merger << profile.merge(samples: "3") }
+    assert_equal StackProf.merge(profile), merger.result
+  end
+
+  def test_timestamps
+    profile = StackProf.run(mode: :custom, timestamps: true) do
+      StackProf.sample
+      sleep 0.02
+      StackProf.sample
+      StackProf.sample
+    end
+
+    deltas = profile[:raw_timestamp_deltas]
+    assert_equal 3, profile[:raw_samples].size / 2
+    assert_equal 3, deltas.size
+    assert_operator deltas[1], :>=, 20_000
+    assert_operator deltas[2], :<, 20_000
+    assert_kind_of Float, profile[:raw_start_time]
+
+    report = StackProf::Report.new(profile)
+    assert_equal deltas.inject(:+), report.raw_timestamps.last
+    out = StringIO.new
+    report.print_flamegraph(out, false)
+    # the sleep leaves a gap of about 20 columns (ms, in custom mode)
+    xs = out.string.scan(/"x":(\d+),"y":0,/).flatten.map(&:to_i)
+    assert_equal 0, xs[0]
+    assert_operator xs[1], :>=, 19
+  end
+
+  def test_flamegraph_rows
+    profile = StackProf.run(mode: :custom, raw: true) do
+      3.times{ StackProf.sample }
+      [1].each{ StackProf.sample; [2].each{ StackProf.sample } }
+      StackProf.sample
+    end
+    report = StackProf::Report.new(profile)
+
+    columns = []
+    report.each_raw_sample{ |frames, weight| weight.times{ columns << frames } }
+
+    out = StringIO.new
+    report.print_flamegraph(out, false)
+    rows = JSON.parse(out.string.sub(/\Aflamegraph\(/, '').sub(/\)\s*\z/, ''))
+    cells = Array.new(columns.size){ [] }
+    rows.each do |row|
+      row["width"].times{ |i| cells[row["x"] + i][row["y"]] = row["frame_id"] }
+    end
+    assert_equal columns, cells
+
+    # every row is as wide as it can be
+    rows.group_by{ |row| row["y"] }.each_value do |level|
+      level.sort_by{ |row| row["x"] }.each_cons(2) do |a, b|
+        refute(a["x"] + a["width"] == b["x"] && a["frame_id"] == b["frame_id"])
+      end
+    end
+
+    collapsed, _ = capture_io{ report.print_stackcollapse }
+    expected = []
+    report.each_raw_sample{ |frames, weight| expected << "#{frames.map{ |id| profile[:frames][id][:name] }.join(';')} #{weight}" }
+    assert_equal expected, collapsed.lines.map(&:chomp)
   end
 
   def test_fork
@@ -119,6 +557,34 @@ class StackProfTest < MiniTest::Test
     end
   end
 
+  def test_follow_fork
+    Tempfile.create('stackprof-fork') do |file|
+      StackProf.start(mode: :cpu, interval: 500, raw: true, follow_fork: true, out: file.path)
+      5.times{ math }
+      pid = fork do
+        running = StackProf.running?
+        spin(0.05)
+        StackProf.stop
+        StackProf.results
+        exit! running ? 0 : 1
+      end
+      Process.wait(pid)
+      StackProf.stop
+      StackProf.results
+      parent = Marshal.load(File.binread(file.path))
+
+      assert_equal 0, $?.exitstatus
+      child = Marshal.load(File.binread("#{file.path}.#{pid}"))
+      File.unlink("#{file.path}.#{pid}")
+      assert_equal pid, child[:pid]
+      assert_equal Process.pid, parent[:pid]
+      assert parent[:frames].values.any?{ |f| f[:name] == 'StackProfTest#math' }
+      assert_operator child[:samples], :>, 0
+      assert child[:frames].values.any?{ |f| f[:name] == 'StackProfTest#spin' }
+      refute child[:frames].values.any?{ |f| f[:name] == 'StackProfTest#math' }
+    end
+  end
+
   def test_gc
     profile = StackProf.run(interval: 100) do
       5.times do
@@ -126,11 +592,24 @@ class StackProfTest < MiniTest::Test
       end
     end
 
-    assert_empty profile[:frames]
+    gc_frame = profile[:frames].values.find{ |f| f[:name] == "(garbage collection)" }
+    assert_operator gc_frame[:total_samples], :>, 0
+    assert profile[:frames].values.any?{ |f| f[:name] =~ /\A\((marking|sweeping)\)\z/ }
     assert_operator profile[:gc_samples], :>, 0
     assert_equal 0, profile[:missed_samples]
   end
 
+  def test_gc_ignored
+    profile = StackProf.run(interval: 100, ignore_gc: true) do
+      5.times do
+        GC.start
+      end
+    end
+
+    assert_operator profile[:gc_samples], :>, 0
+    refute profile[:frames].values.any?{ |f| f[:name] =~ /\A\((garbage collection|marking|sweeping)\)\z/ }
+  end
+
   def test_out
     tmpfile = Tempfile.new('stackprof-out')
     ret = StackProf.run(mode: :custom, out: tmpfile) do
@@ -143,12 +622,116 @@ class StackProfTest < MiniTest::Test
     refute_empty profile[:frames]
   end
 
+  def test_out_binary
+    tmpfile = Tempfile.new('stackprof-out')
+    ret = StackProf.run(mode: :custom, out: tmpfile, format: :binary, raw: true) do
+      StackProf.sample
+      StackProf.sample
+    end
+
+    assert_equal tmpfile, ret
+    report = StackProf::Report.load(tmpfile.path)
+    assert_kind_of StackProf::BinaryDump, report.data
+    assert_equal :custom, report.data[:mode]
+    assert_equal 2, report.data[:samples]
+
+    frames = report.data[:frames]
+    name = frames.values.map{ |f| f[:name] }
+    assert_includes name, 'StackProfTest#test_out_binary'
+    frames.each_value do |frame|
+      assert_equal frame[:total_samples], frame[:samples] + (frame[:edges] || {}).values.inject(0, :+)
+    end
+
+    stacks = []
+    report.each_raw_sample{ |stack, weight| stacks << [stack, weight] }
+    assert_equal 1, stacks.size
+    assert_equal 2, stacks[0][1]
+    stacks[0][0].each{ |id| assert frames[id] }
+  end
+
+  def test_snapshot
+    StackProf.start(mode: :cpu, raw: true)
+    spin(0.05)
+    first = StackProf.snapshot
+    assert StackProf.running?
+    spin(0.05)
+    second = StackProf.snapshot
+    StackProf.stop
+    last = StackProf.results
+
+    [first, second].each do |profile|
+      assert_equal :cpu, profile[:mode]
+      assert_operator profile[:samples], :>, 0
+      assert profile[:frames].values.any?{ |f| f[:name] == 'StackProfTest#spin' }
+      assert_equal profile[:samples], profile[:raw_samples].each_slice(2).map(&:last).inject(0, :+) + profile[:gc_samples]
+    end
+    assert_operator last[:samples], :<, first[:samples]
+    assert_nil StackProf.snapshot
+  end
+
+  def test_snapshot_keeps_only_its_frames_resolved
+    eval("def first_snapshot_frame; StackProf.sample; end", nil, "first.rb", 1)
+    eval("def second_snapshot_frame; StackProf.sample; end", nil, "second.rb", 1)
+    out = Tempfile.new('stackprof-snapshot')
+    StackProf.start(mode: :custom, format: :binary)
+    3.times{ first_snapshot_frame }
+    StackProf.snapshot(out.path)
+    3.times{ second_snapshot_frame }
+    StackProf.snapshot(out.path)
+    stats = StackProf.stats
+    second = StackProf::BinaryDump.new(File.binread(out.path))
+    StackProf.stop
+    StackProf.results
+
+    assert_equal second[:frames].size, stats[:symbols]
+    assert_includes second.strings, "second.rb"
+    refute_includes second.strings, "first.rb"
+  end
+
+  def test_snapshot_heap_mode
+    StackProf.start(mode: :heap)
+    assert_raises(RuntimeError){ StackProf.snapshot }
+  ensure
+    StackProf.stop
+    StackProf.results
+  end
+
+  def test_binary_report_is_lazy
+    tmpfile = Tempfile.new('stackprof-out')
+    StackProf.run(mode: :cpu, out: tmpfile, format: :binary, raw: true) do
+      spin(0.1)
+    end
+
+    lazy = StackProf::Report.load(tmpfile.path)
+    full = StackProf::Report.new(StackProf::BinaryDump.load(tmpfile.path).to_h)
+
+    assert_equal capture_io{ full.print_text(false, 5) }, capture_io{ lazy.print_text(false, 5) }
+    assert_operator lazy.data[:frames].instance_variable_get(:@frames).size, :<=, 5
+
+    assert_equal capture_io{ full.print_method(/spin/) }, capture_io{ lazy.print_method(/spin/) }
+    assert_equal full.files, lazy.files
+    assert_equal capture_io{ full.print_flamegraph }, capture_io{ lazy.print_flamegraph }
+  end
+
+  def allocate_a
+    Object.new
+  end
+
+  def allocate_b
+    Object.new
+  end
+
   def math
     250_000.times do
       2 ** 10
     end
   end
 
+  def spin(seconds)
+    deadline = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) + seconds
+    nil while Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) < deadline
+  end
+
   def idle
     r, w = IO.pipe
     IO.select([r], nil, nil, 0.2)
@@ -0,0 +1,61 @@
+$:.unshift File.expand_path('../../lib', __FILE__)
+require 'stackprof'
+require 'minitest/autorun'
+require 'tmpdir'
+
+class StackProf::WriterTest < MiniTest::Test
+  # stalls the writer thread inside Marshal.dump until released
+  class Stall
+    def initialize(queue)
+      @queue = queue
+    end
+
+    def marshal_dump
+      @queue.pop
+      nil
+    end
+
+    def marshal_load(_)
+    end
+  end
+
+  def test_write
+    Dir.mktmpdir do |dir|
+      writer = StackProf::Writer.new
+      profile = StackProf.run(mode: :custom){ StackProf.sample }
+      assert writer.write(File.join(dir, 'sub', 'a.dump'), profile)
+      writer.close
+
+      assert_equal 1, writer.written
+      assert_equal profile, Marshal.load(File.binread(File.join(dir, 'sub', 'a.dump')))
+    end
+  end
+
+  def test_drops_when_full
+    Dir.mktmpdir do |dir|
+      release = Queue.new
+      writer = StackProf::Writer.new(max_pending: 1)
+      assert writer.write(File.join(dir, 'a.dump'), Stall.new(release))
+      Thread.pass while writer.pending > 0
+      assert writer.write(File.join(dir, 'b.dump'), {})
+      refute writer.write(File.join(dir, 'c.dump'), {})
+      assert_equal 1, writer.dropped
+
+      release << true
+      writer.close
+      assert_equal 2, writer.written
+      refute File.exist?(File.join(dir, 'c.dump'))
+    end
+  end
+
+  def test_concurrent_writes_start_one_thread
+    Dir.mktmpdir do |dir|
+      writer = StackProf::Writer.new(max_pending: 8)
+      8.times.map{ |i| Thread.new{ writer.write(File.join(dir, "#{i}.dump"), {}) } }.each(&:join)
+      assert_equal 1, Thread.list.count{ |t| t.name == 'stackprof-writer' }
+      writer.close
+
+      assert_equal 8, writer.written
+    end
+  end
+end